@@ -0,0 +1,839 @@
+/* Throughput benchmarks for the UTF-7 and UTF-8 codecs
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Every benchmark runs over a set of reproducible, generated corpora and
+ * across a range of buffer sizes, from a single byte up to 1MiB. Results
+ * are written to standard output as tab-separated values, one row per
+ * measurement, with a header row. Throughput is measured against the
+ * size of the encoded side of each operation: the UTF-7 or UTF-8 bytes
+ * produced by an encoder or consumed by a decoder or pipeline.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utf8.h"
+#include "getopt.h"
+#include "../utf7.h"
+
+#define MAXBUF (1L << 20)
+
+struct corpus {
+    const char *name;
+    long *cp;       /* code points */
+    size_t ncp;
+    char *u7;       /* UTF-7 encoding */
+    size_t n7;
+    char *u8;       /* UTF-8 encoding */
+    size_t n8;
+    char *l1;       /* the low byte of each code point, as Latin-1 */
+};
+
+static void *
+xmalloc(size_t n)
+{
+    void *p = malloc(n ? n : 1);
+    if (!p) {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* Read the CPU timestamp counter, or zero where there isn't one. */
+static double
+cycles(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return hi * 4294967296.0 + lo;
+#else
+    return 0;
+#endif
+}
+
+/* A small, portable PRNG so that corpora are identical everywhere. */
+static unsigned long
+rng(unsigned long *s)
+{
+    *s = (*s * 1103515245UL + 12345UL) & 0xffffffffUL;
+    return *s >> 16;
+}
+
+static long
+pick(unsigned long *s, const char *set)
+{
+    return set[rng(s) % strlen(set)];
+}
+
+static long
+range(unsigned long *s, long lo, long hi)
+{
+    return lo + (long)(rng(s) % (unsigned long)(hi - lo + 1));
+}
+
+enum kind {
+    K_ASCII, K_HEADERS, K_LATIN, K_CYRILLIC, K_CJK, K_EMOJI, K_PLUS
+};
+
+static const char *const kind_names[] = {
+    "ascii", "headers", "latin", "cyrillic", "cjk", "emoji", "plus"
+};
+
+/* Generate n code points of the given kind of text. */
+static void
+generate(long *cp, size_t n, enum kind kind)
+{
+    static const char lower[] = "etaoinshrdlcumwfgypbvkjxqz";
+    static const char *const fields[] = {
+        "From: ", "To: ", "Subject: ", "Message-ID: <", "Date: ",
+        "Content-Type: text/plain; charset=utf-7", "Received: from "
+    };
+    unsigned long s = 0x7e7e7eUL + kind;
+    size_t i = 0;
+
+    while (i < n) {
+        long c;
+        size_t j, w;
+        switch (kind) {
+            case K_ASCII:
+                w = range(&s, 1, 9);
+                for (j = 0; j < w && i < n; j++)
+                    cp[i++] = pick(&s, lower);
+                if (i < n)
+                    cp[i++] = rng(&s) % 12 ? 0x20 : pick(&s, ".,\n");
+                break;
+            case K_HEADERS:
+                if (!(rng(&s) % 4)) {
+                    const char *f = fields[rng(&s) % 7];
+                    for (; *f && i < n; f++)
+                        cp[i++] = *f;
+                }
+                w = range(&s, 2, 12);
+                for (j = 0; j < w && i < n; j++)
+                    cp[i++] = pick(&s, "abcdefghijklmnopqrstuvwxyz0123456789");
+                if (i < n)
+                    cp[i++] = pick(&s, "  @.=;<>-_\n");
+                break;
+            case K_LATIN:
+                w = range(&s, 1, 9);
+                for (j = 0; j < w && i < n; j++) {
+                    if (rng(&s) % 20)
+                        cp[i++] = pick(&s, lower);
+                    else
+                        cp[i++] = range(&s, 0xe0, 0xfc);
+                }
+                if (i < n)
+                    cp[i++] = rng(&s) % 12 ? 0x20 : pick(&s, ".,\n");
+                break;
+            case K_CYRILLIC:
+                w = range(&s, 2, 10);
+                for (j = 0; j < w && i < n; j++)
+                    cp[i++] = range(&s, 0x430, 0x44f);
+                if (i < n)
+                    cp[i++] = rng(&s) % 12 ? 0x20 : pick(&s, ".,\n");
+                break;
+            case K_CJK:
+                w = range(&s, 8, 40);
+                for (j = 0; j < w && i < n; j++)
+                    cp[i++] = range(&s, 0x4e00, 0x9fff);
+                if (i < n)
+                    cp[i++] = rng(&s) % 4 ? 0x3002 : 0x0a;
+                break;
+            case K_EMOJI:
+                c = rng(&s) % 3;
+                w = range(&s, 1, 6);
+                for (j = 0; j < w && i < n; j++)
+                    cp[i++] = c ? range(&s, 0x1f300, 0x1f64f) : pick(&s, lower);
+                if (i < n)
+                    cp[i++] = 0x20;
+                break;
+            case K_PLUS:
+                switch (rng(&s) % 3) {
+                    case 0: /* escaped plus signs */
+                        cp[i++] = 0x2b;
+                        break;
+                    case 1: /* alternating direct and indirect */
+                        cp[i++] = pick(&s, lower);
+                        if (i < n)
+                            cp[i++] = range(&s, 0x80, 0x7ff);
+                        break;
+                    case 2: /* a segment that needs its '-' */
+                        cp[i++] = 0x20ac;
+                        if (i < n)
+                            cp[i++] = 0x2d;
+                        break;
+                }
+                break;
+        }
+    }
+}
+
+/* Fill in the UTF-7 and UTF-8 encodings of a corpus. */
+static void
+prepare(struct corpus *c)
+{
+    size_t i;
+    struct utf7 u7;
+    struct utf8 u8;
+
+    c->u7 = xmalloc(c->ncp * 8 + 8);
+    utf7_init(&u7, 0);
+    u7.buf = c->u7;
+    u7.len = c->ncp * 8 + 8;
+    for (i = 0; i < c->ncp; i++)
+        utf7_encode(&u7, c->cp[i]);
+    utf7_encode(&u7, UTF7_FLUSH);
+    c->n7 = u7.buf - c->u7;
+
+    c->u8 = xmalloc(c->ncp * 4);
+    utf8_init(&u8);
+    u8.buf = c->u8;
+    u8.len = c->ncp * 4;
+    for (i = 0; i < c->ncp; i++)
+        utf8_encode(&u8, c->cp[i]);
+    c->n8 = u8.buf - c->u8;
+
+    c->l1 = xmalloc(c->ncp);
+    for (i = 0; i < c->ncp; i++)
+        c->l1[i] = (char)(c->cp[i] & 0xff);
+}
+
+static char  *obuf;  /* output buffer, MAXBUF bytes */
+static long  *cbuf;  /* code point buffer, MAXBUF entries */
+static char  *amem;  /* arena memory, ARENA bytes */
+
+#define ARENA (MAXBUF * 32)
+
+/* Each benchmark processes one corpus in chunks of buflen and returns
+ * the number of encoded bytes it handled.
+ */
+typedef size_t (*bench)(const struct corpus *, size_t buflen);
+
+static size_t
+bench_utf7_encode(const struct corpus *c, size_t buflen)
+{
+    size_t i, total = 0;
+    struct utf7 ctx;
+    utf7_init(&ctx, 0);
+    ctx.buf = obuf;
+    ctx.len = buflen;
+    for (i = 0; i <= c->ncp; i++) {
+        long cp = i < c->ncp ? c->cp[i] : UTF7_FLUSH;
+        while (utf7_encode(&ctx, cp) != UTF7_OK) {
+            total += buflen;
+            ctx.buf = obuf;
+            ctx.len = buflen;
+        }
+    }
+    return total + (ctx.buf - obuf);
+}
+
+static size_t
+bench_utf7_decode(const struct corpus *c, size_t buflen)
+{
+    size_t off = 0;
+    struct utf7 ctx;
+    utf7_init(&ctx, 0);
+    ctx.buf = c->u7;
+    ctx.len = 0;
+    for (;;) {
+        long r = utf7_decode(&ctx);
+        if (r == UTF7_OK || r == UTF7_INCOMPLETE) {
+            if (off == c->n7)
+                break;
+            ctx.len = c->n7 - off < buflen ? c->n7 - off : buflen;
+            off += ctx.len;
+        } else if (r == UTF7_INVALID) {
+            abort();
+        }
+    }
+    return c->n7;
+}
+
+/* Latin-1 input, one byte at a time through utf7_encode() */
+static size_t
+bench_utf7_encode_bytes(const struct corpus *c, size_t buflen)
+{
+    size_t i, total = 0;
+    struct utf7 ctx;
+    utf7_init(&ctx, 0);
+    ctx.buf = obuf;
+    ctx.len = buflen;
+    for (i = 0; i <= c->ncp; i++) {
+        long cp = i < c->ncp ? (unsigned char)c->l1[i] : UTF7_FLUSH;
+        while (utf7_encode(&ctx, cp) != UTF7_OK) {
+            total += buflen;
+            ctx.buf = obuf;
+            ctx.len = buflen;
+        }
+    }
+    return total + (ctx.buf - obuf);
+}
+
+static size_t
+bench_utf7_encode_latin1(const struct corpus *c, size_t buflen)
+{
+    size_t off = 0, total = 0;
+    struct utf7 ctx;
+    utf7_init(&ctx, 0);
+    ctx.buf = obuf;
+    ctx.len = buflen;
+    for (;;) {
+        off += utf7_encode_latin1(&ctx, c->l1 + off, c->ncp - off);
+        if (off == c->ncp && utf7_encode(&ctx, UTF7_FLUSH) == UTF7_OK)
+            break;
+        total += ctx.buf - obuf;
+        ctx.buf = obuf;
+        ctx.len = buflen;
+    }
+    return total + (ctx.buf - obuf);
+}
+
+/* Latin-1 output, skipping over whatever it can't represent */
+static size_t
+bench_utf7_decode_latin1(const struct corpus *c, size_t buflen)
+{
+    struct utf7 ctx;
+    utf7_init(&ctx, 0);
+    ctx.buf = c->u7;
+    ctx.len = c->n7;
+    for (;;) {
+        size_t n = buflen;
+        long r = utf7_decode_latin1(&ctx, obuf, &n);
+        if (r == UTF7_OK)
+            break;
+        else if (r == UTF7_INVALID || r == UTF7_INCOMPLETE)
+            abort();
+    }
+    return c->n7;
+}
+
+/* Independent messages of buflen code points, each encoded into a
+ * fresh malloc() buffer that doubles with realloc() on UTF7_FULL.
+ */
+static size_t
+bench_utf7_encode_realloc(const struct corpus *c, size_t buflen)
+{
+    size_t i, total = 0;
+    for (i = 0; i < c->ncp; i += buflen) {
+        size_t j, n = c->ncp - i < buflen ? c->ncp - i : buflen;
+        size_t cap = n + UTF7_MAX_ENCODE;
+        char *buf = xmalloc(cap);
+        struct utf7 ctx;
+        utf7_init(&ctx, 0);
+        ctx.buf = buf;
+        ctx.len = cap;
+        for (j = 0; j <= n; j++) {
+            long cp = j < n ? c->cp[i + j] : UTF7_FLUSH;
+            while (utf7_encode(&ctx, cp) != UTF7_OK) {
+                size_t used = ctx.buf - buf;
+                buf = realloc(buf, cap *= 2);
+                if (!buf)
+                    abort();
+                ctx.buf = buf + used;
+                ctx.len = cap - used;
+            }
+        }
+        total += ctx.buf - buf;
+        free(buf);
+    }
+    return total;
+}
+
+/* The same messages through utf7_encode_alloc() and a reset arena */
+static size_t
+bench_utf7_encode_alloc(const struct corpus *c, size_t buflen)
+{
+    size_t i, total = 0;
+    for (i = 0; i < c->ncp; i += buflen) {
+        size_t n = c->ncp - i < buflen ? c->ncp - i : buflen;
+        struct utf7_arena arena;
+        struct utf7_output out;
+        struct utf7 ctx;
+        arena.beg = amem;
+        arena.end = amem + ARENA;
+        utf7_init(&ctx, 0);
+        if (utf7_encode_alloc(&ctx, c->cp + i, n, UTF7_GATHER,
+                              utf7_arena_alloc, &arena, &out) != UTF7_OK)
+            abort();
+        total += out.total;
+    }
+    return total;
+}
+
+static int
+bench_sink(void *user, const char *buf, size_t len)
+{
+    *(size_t *)user += len;
+    (void)buf;
+    return 0;
+}
+
+/* The push-mode writer, staging into buflen bytes of obuf. */
+static size_t
+bench_utf7_write(const struct corpus *c, size_t buflen)
+{
+    size_t i, total = 0;
+    struct utf7_writer w;
+    if (buflen < UTF7_MAX_ENCODE)
+        buflen = UTF7_MAX_ENCODE;
+    utf7_writer_init(&w, 0, obuf, buflen, bench_sink, &total);
+    for (i = 0; i < c->ncp; i++)
+        utf7_write(&w, c->cp[i]);
+    utf7_write(&w, UTF7_FLUSH);
+    return total;
+}
+
+struct bench_source {
+    const char *p;
+    size_t len;
+};
+
+static long
+bench_source(void *user, char *buf, size_t len)
+{
+    struct bench_source *s = user;
+    size_t z = len < s->len ? len : s->len;
+    memcpy(buf, s->p, z);
+    s->p += z;
+    s->len -= z;
+    return (long)z;
+}
+
+/* The pull-mode reader, refilling buflen bytes of obuf at a time. */
+static size_t
+bench_utf7_read(const struct corpus *c, size_t buflen)
+{
+    struct bench_source s;
+    struct utf7_reader r;
+    long cp;
+    s.p = c->u7;
+    s.len = c->n7;
+    utf7_reader_init(&r, obuf, buflen, bench_source, &s);
+    while ((cp = utf7_read(&r)) >= 0)
+        ;
+    if (cp != UTF7_OK)
+        abort();
+    return c->n7;
+}
+
+/* A pattern absent from every corpus, so that searches scan it all.
+ * Its code points are distinct, which keeps the naive matcher simple.
+ */
+static const long needle[] = {0x71, 0x7a, 0x2603};
+#define NEEDLE (sizeof(needle) / sizeof(*needle))
+
+/* Search the encoded text directly. The buffer length doesn't apply. */
+static size_t
+bench_utf7_search(const struct corpus *c, size_t buflen)
+{
+    size_t table[2 * NEEDLE];
+    struct utf7_search s;
+    struct utf7_match m;
+    utf7_search_init(&s, needle, NEEDLE, table);
+    if (utf7_search(&s, c->u7, c->n7, 0, &m) != 0)
+        abort();
+    (void)buflen;
+    return c->n7;
+}
+
+/* The alternative: decode everything and search the code points. */
+static size_t
+bench_utf7_decode_search(const struct corpus *c, size_t buflen)
+{
+    size_t k = 0, off = 0;
+    struct utf7 ctx;
+    utf7_init(&ctx, 0);
+    ctx.buf = c->u7;
+    ctx.len = 0;
+    for (;;) {
+        long r = utf7_decode(&ctx);
+        if (r >= 0) {
+            /* the needle's code points are distinct */
+            if (needle[k] == r)
+                k++;
+            else
+                k = needle[0] == r;
+            if (k == NEEDLE)
+                abort();
+        } else if (r != UTF7_INVALID && off < c->n7) {
+            ctx.len = c->n7 - off < buflen ? c->n7 - off : buflen;
+            off += ctx.len;
+        } else {
+            break;
+        }
+    }
+    return c->n7;
+}
+
+/* Sniff the whole encoded text. The buffer length doesn't apply. */
+static size_t
+bench_utf7_sniff(const struct corpus *c, size_t buflen)
+{
+    struct utf7_sniff r;
+    if (utf7_sniff(c->u7, c->n7, &r) == UTF7_SNIFF_OTHER)
+        abort();
+    (void)buflen;
+    return r.scanned;
+}
+
+/* Canonicalize text that is already canonical, buflen at a time. */
+static size_t
+bench_utf7_canonicalize(const struct corpus *c, size_t buflen)
+{
+    size_t off = 0;
+    struct utf7 enc, dec;
+    if (buflen < UTF7_MAX_ENCODE)
+        buflen = UTF7_MAX_ENCODE;
+    utf7_init(&enc, 0);
+    utf7_init(&dec, 0);
+    enc.buf = obuf;
+    enc.len = buflen;
+    dec.buf = c->u7;
+    dec.len = 0;
+    for (;;) {
+        int r = utf7_canonicalize(&enc, &dec);
+        if (r == UTF7_FULL) {
+            enc.buf = obuf;
+            enc.len = buflen;
+        } else if (r == UTF7_INVALID) {
+            abort();
+        } else if (off == c->n7) {
+            break;
+        } else {
+            dec.len = c->n7 - off < buflen ? c->n7 - off : buflen;
+            off += dec.len;
+        }
+    }
+    return c->n7;
+}
+
+/* The alternative: decode and re-encode every code point. */
+static size_t
+bench_utf7_recode(const struct corpus *c, size_t buflen)
+{
+    size_t off = 0;
+    struct utf7 enc, dec;
+    utf7_init(&enc, 0);
+    utf7_init(&dec, 0);
+    enc.buf = obuf;
+    enc.len = buflen;
+    dec.buf = c->u7;
+    dec.len = 0;
+    for (;;) {
+        long r = utf7_decode(&dec);
+        if (r >= 0) {
+            while (utf7_encode(&enc, r) != UTF7_OK) {
+                enc.buf = obuf;
+                enc.len = buflen;
+            }
+        } else if (r == UTF7_INVALID) {
+            abort();
+        } else if (off == c->n7) {
+            break;
+        } else {
+            dec.len = c->n7 - off < buflen ? c->n7 - off : buflen;
+            off += dec.len;
+        }
+    }
+    return c->n7;
+}
+
+static size_t
+bench_utf8_encode(const struct corpus *c, size_t buflen)
+{
+    size_t i, total = 0;
+    struct utf8 ctx;
+    utf8_init(&ctx);
+    ctx.buf = obuf;
+    ctx.len = buflen;
+    for (i = 0; i <= c->ncp; i++) {
+        long cp = i < c->ncp ? c->cp[i] : UTF8_FLUSH;
+        while (utf8_encode(&ctx, cp) != UTF8_OK) {
+            total += buflen;
+            ctx.buf = obuf;
+            ctx.len = buflen;
+        }
+    }
+    return total + (ctx.buf - obuf);
+}
+
+static size_t
+bench_utf8_encode_block(const struct corpus *c, size_t buflen)
+{
+    size_t i = 0, total = 0;
+    struct utf8 ctx;
+    utf8_init(&ctx);
+    ctx.buf = obuf;
+    ctx.len = buflen;
+    while (i < c->ncp) {
+        size_t n = utf8_encode_block(&ctx, c->cp + i, c->ncp - i);
+        if (!n && utf8_encode(&ctx, c->cp[i]) == UTF8_OK)
+            n = 1;
+        i += n;
+        if (!ctx.len) {
+            total += buflen;
+            ctx.buf = obuf;
+            ctx.len = buflen;
+        }
+    }
+    while (utf8_encode(&ctx, UTF8_FLUSH) != UTF8_OK) {
+        total += buflen;
+        ctx.buf = obuf;
+        ctx.len = buflen;
+    }
+    return total + (ctx.buf - obuf);
+}
+
+static size_t
+bench_utf8_decode(const struct corpus *c, size_t buflen)
+{
+    size_t off = 0;
+    struct utf8 ctx;
+    utf8_init(&ctx);
+    ctx.buf = c->u8;
+    ctx.len = 0;
+    for (;;) {
+        long r = utf8_decode(&ctx);
+        if (r == UTF8_OK || r == UTF8_INCOMPLETE) {
+            if (off == c->n8)
+                break;
+            ctx.len = c->n8 - off < buflen ? c->n8 - off : buflen;
+            off += ctx.len;
+        } else if (r == UTF8_INVALID) {
+            abort();
+        }
+    }
+    return c->n8;
+}
+
+static size_t
+bench_utf8_decode_block(const struct corpus *c, size_t buflen)
+{
+    size_t off = 0;
+    struct utf8 ctx;
+    utf8_init(&ctx);
+    ctx.buf = c->u8;
+    ctx.len = 0;
+    for (;;) {
+        long r;
+        if (utf8_decode_block(&ctx, cbuf, MAXBUF))
+            continue;
+        r = utf8_decode(&ctx);
+        if (r == UTF8_OK || r == UTF8_INCOMPLETE) {
+            if (off == c->n8)
+                break;
+            ctx.len = c->n8 - off < buflen ? c->n8 - off : buflen;
+            off += ctx.len;
+        } else if (r == UTF8_INVALID) {
+            abort();
+        }
+    }
+    return c->n8;
+}
+
+/* A minimal transcoding loop between UTF-8 and UTF-7: decode one code
+ * point, encode it, drain the output whenever it fills, and pass
+ * through all-direct spans. This is the core of what conv7 does, but
+ * not conv7 itself, which adds BOM, -r, -l, and Latin-1 handling, and
+ * stdio on top.
+ */
+static size_t
+bench_pipeline(const struct corpus *c, size_t buflen, int to7)
+{
+    size_t off = 0;
+    const char *in = to7 ? c->u8 : c->u7;
+    size_t inlen = to7 ? c->n8 : c->n7;
+    struct utf7 u7;
+    struct utf8 u8;
+    char **ibuf = to7 ? &u8.buf : &u7.buf;
+    size_t *ilen = to7 ? &u8.len : &u7.len;
+    char **xbuf = to7 ? &u7.buf : &u8.buf;
+    size_t *xlen = to7 ? &u7.len : &u8.len;
+
+    utf7_init(&u7, 0);
+    utf8_init(&u8);
+    *ibuf = (char *)in;
+    *ilen = 0;
+    *xbuf = obuf;
+    *xlen = buflen;
+
+    for (;;) {
+        long r;
+        size_t n;
+
+        if (to7) {
+            n = utf8_decode_span(&u8, u8.buf, u8.len);
+            n = utf7_encode_span(&u7, u8.buf, n);
+        } else {
+            n = utf7_decode_span(&u7, u7.buf, u7.len);
+            n = utf8_encode_span(&u8, u7.buf, n);
+        }
+        while (n) {
+            size_t z = n < *xlen ? n : *xlen;
+            memcpy(*xbuf, *ibuf, z);
+            *xbuf += z;
+            *xlen -= z;
+            *ibuf += z;
+            *ilen -= z;
+            n -= z;
+            if (!*xlen) {
+                *xbuf = obuf;
+                *xlen = buflen;
+            }
+        }
+
+        r = to7 ? utf8_decode(&u8) : utf7_decode(&u7);
+        if (r == UTF7_OK || r == UTF7_INCOMPLETE) {
+            if (off == inlen)
+                break;
+            *ilen = inlen - off < buflen ? inlen - off : buflen;
+            off += *ilen;
+            continue;
+        } else if (r == UTF7_INVALID) {
+            abort();
+        }
+
+        while ((to7 ? utf7_encode(&u7, r) : utf8_encode(&u8, r)) != UTF7_OK) {
+            *xbuf = obuf;
+            *xlen = buflen;
+        }
+    }
+    while ((to7 ? utf7_encode(&u7, -1) : utf8_encode(&u8, -1)) != UTF7_OK) {
+        *xbuf = obuf;
+        *xlen = buflen;
+    }
+    return inlen;
+}
+
+static size_t
+bench_pipeline_8to7(const struct corpus *c, size_t buflen)
+{
+    return bench_pipeline(c, buflen, 1);
+}
+
+static size_t
+bench_pipeline_7to8(const struct corpus *c, size_t buflen)
+{
+    return bench_pipeline(c, buflen, 0);
+}
+
+static const struct {
+    const char *name;
+    bench run;
+} benches[] = {
+    {"utf7_encode",       bench_utf7_encode},
+    {"utf7_decode",       bench_utf7_decode},
+    {"utf7_write",        bench_utf7_write},
+    {"utf7_read",         bench_utf7_read},
+    {"utf7_search",       bench_utf7_search},
+    {"utf7_decode_search", bench_utf7_decode_search},
+    {"utf7_canonicalize", bench_utf7_canonicalize},
+    {"utf7_sniff",        bench_utf7_sniff},
+    {"utf7_recode",       bench_utf7_recode},
+    {"utf7_encode_bytes", bench_utf7_encode_bytes},
+    {"utf7_encode_latin1", bench_utf7_encode_latin1},
+    {"utf7_decode_latin1", bench_utf7_decode_latin1},
+    {"utf7_encode_realloc", bench_utf7_encode_realloc},
+    {"utf7_encode_alloc", bench_utf7_encode_alloc},
+    {"utf8_encode",       bench_utf8_encode},
+    {"utf8_encode_block", bench_utf8_encode_block},
+    {"utf8_decode",       bench_utf8_decode},
+    {"utf8_decode_block", bench_utf8_decode_block},
+    {"pipeline_utf8_utf7", bench_pipeline_8to7},
+    {"pipeline_utf7_utf8", bench_pipeline_7to8},
+};
+
+static void
+usage(FILE *f)
+{
+    fprintf(f, "usage: bench [-h] [-b NAME] [-c NAME] [-n CP] [-t SECS]\n");
+    fprintf(f, "  -b NAME   only run the named benchmark\n");
+    fprintf(f, "  -c NAME   only use the named corpus\n");
+    fprintf(f, "  -h        print this help info\n");
+    fprintf(f, "  -n CP     code points per corpus [262144]\n");
+    fprintf(f, "  -t SECS   minimum time per measurement [0.1]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    static const size_t sizes[] = {1, 16, 256, 4096, 65536, MAXBUF};
+    size_t ncp = 1UL << 18;
+    double mintime = 0.1;
+    const char *only_bench = 0;
+    const char *only_corpus = 0;
+    struct corpus corpora[sizeof(kind_names) / sizeof(*kind_names)];
+    int ncorpora = sizeof(corpora) / sizeof(*corpora);
+    int option, i, b;
+
+    while ((option = getopt(argc, argv, "b:c:hn:t:")) != -1) {
+        switch (option) {
+            case 'b':
+                only_bench = optarg;
+                break;
+            case 'c':
+                only_corpus = optarg;
+                break;
+            case 'h':
+                usage(stdout);
+                exit(EXIT_SUCCESS);
+                break;
+            case 'n':
+                ncp = strtoul(optarg, 0, 10);
+                break;
+            case 't':
+                mintime = strtod(optarg, 0);
+                break;
+            default:
+                usage(stderr);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    obuf = xmalloc(MAXBUF);
+    cbuf = xmalloc(MAXBUF * sizeof(*cbuf));
+    amem = xmalloc(ARENA);
+    for (i = 0; i < ncorpora; i++) {
+        corpora[i].name = kind_names[i];
+        corpora[i].ncp = ncp;
+        corpora[i].cp = xmalloc(ncp * sizeof(long));
+        generate(corpora[i].cp, ncp, (enum kind)i);
+        prepare(corpora + i);
+    }
+
+    printf("corpus\tbench\tbuflen\tbytes\tseconds\tMB/s\tcycles/byte\n");
+    for (i = 0; i < ncorpora; i++) {
+        if (only_corpus && strcmp(only_corpus, corpora[i].name))
+            continue;
+        for (b = 0; b < (int)(sizeof(benches) / sizeof(*benches)); b++) {
+            size_t s;
+            if (only_bench && strcmp(only_bench, benches[b].name))
+                continue;
+            for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+                double secs;
+                double cy = cycles();
+                clock_t start = clock();
+                double bytes = 0;
+                do {
+                    bytes += benches[b].run(corpora + i, sizes[s]);
+                    secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+                } while (secs < mintime);
+                cy = cycles() - cy;
+                printf("%s\t%s\t%lu\t%.0f\t%.4f\t%.2f\t",
+                       corpora[i].name, benches[b].name,
+                       (unsigned long)sizes[s], bytes, secs,
+                       bytes / secs / 1e6);
+                if (cy)
+                    printf("%.2f\n", cy / bytes);
+                else
+                    printf("-\n");
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
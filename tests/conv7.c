@@ -6,46 +6,66 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "utf8.h"
 #include "getopt.h"
+#include "polyctx.h"
 #include "../utf7.h"
 
 #define BUFLEN 4096
 
 #define BOM 0xfeffL
 
-#define CTX_OK          -1
-#define CTX_FULL        -2
-#define CTX_INCOMPLETE  -3
-#define CTX_INVALID     -4
+struct ctx;
 
-#define CTX_FLUSH       -1L
-
-union polyctx {
-    struct {
-        char *buf;
-        size_t len;
-    } generic;
-    struct utf7 utf7;
-    struct utf8 utf8;
-};
-
-typedef int  (*encoder)(union polyctx *, long c);
-typedef long (*decoder)(union polyctx *);
+/* Transcode straight between buffers for as long as possible, then
+ * return what the decoder would: a code point for the caller, or the
+ * status that stopped it.
+ */
+typedef long (*bulker)(struct ctx *, unsigned long *lineno);
 
 struct ctx {
     union polyctx to;
     union polyctx fr;
     encoder encode;
     decoder decode;
+    spanner encode_span;
+    spanner decode_span;
+    bulker bulk;                    /* null without a fast path */
+    struct utf7_lenient *lenient;   /* -r, null when strict */
+    long replacement;               /* -r, zero when strict */
+    long max;                       /* largest code point out */
 };
 
-enum encoding {
-    F_UNKNOWN = 0,
-    F_UTF7,
-    F_UTF8
-};
+/* Counters for the -s report. */
+static struct {
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long codepoints;
+    unsigned long passed;       /* bytes copied by passthrough() */
+    unsigned long copied;       /* bytes left alone by -m */
+    unsigned long reads;
+    unsigned long readlen;      /* size of each read */
+    unsigned long writes;
+    unsigned long drains;       /* output buffer filled up */
+    unsigned long replaced;     /* code points missing from the output */
+} stats;
+
+/* Line-independent mode (-l). Every newline leaves both codecs at
+ * rest, so the input can be split at any line boundary. The last one
+ * passed is where a failed run can pick up again with -k.
+ */
+static struct {
+    int on;
+    const char *bo;         /* output buffer, once converting */
+    unsigned long skip;     /* -k, input bytes skipped */
+    unsigned long lines;    /* complete lines, counting skipped ones */
+    unsigned long in;       /* input offset just past the last one */
+    unsigned long out;      /* output offset just past its conversion */
+} linemode;
+
+static void linemode_report(void);
 
 /* Print an error message and immediately exit with a failure.
  *
@@ -69,46 +89,223 @@ die(const char *fmt, ...)
     else
         fputc('\n', stderr);
     va_end(ap);
+    if (linemode.bo)
+        linemode_report();
     exit(EXIT_FAILURE);
 }
 
-static struct {
-    const char name[8];
-    enum encoding e;
-} encoding_table[] = {
-    {"7", F_UTF7},
-    {"utf7", F_UTF7},
-    {"utf-7", F_UTF7},
-    {"UTF7", F_UTF7},
-    {"UTF-7", F_UTF7},
-    {"8", F_UTF8},
-    {"utf8", F_UTF8},
-    {"utf-8", F_UTF8},
-    {"UTF8", F_UTF8},
-    {"UTF-8", F_UTF8}
-};
+enum bom_mode {BOM_PASS, BOM_ADD, BOM_REMOVE};
 
-static enum encoding
-encoding_parse(const char *s)
+/* Report, then forget, the errors replaced by a lenient decoder. */
+static void
+report_errors(struct utf7_lenient *l, unsigned long lineno)
 {
-    int i;
-    for (i = 0; i < (int)sizeof(encoding_table); i++)
-        if (!strcmp(s, encoding_table[i].name))
-            return encoding_table[i].e;
-    return F_UNKNOWN;
+    static const char *const kinds[] = {
+        "", "8-bit byte", "empty shift", "bad trailing bits",
+        "unpaired surrogate"
+    };
+    size_t i;
+    for (i = 0; i < l->count && i < l->cap; i++) {
+        struct utf7_error *e = l->errors + i;
+        fprintf(stderr, "<stdin>:%lu: %s at byte %lu, length %lu\n",
+                lineno, kinds[e->kind], e->offset, e->length);
+    }
+    l->count = 0;
 }
 
-enum bom_mode {BOM_PASS, BOM_ADD, BOM_REMOVE};
+/* Substitute for a code point missing from the output encoding, or
+ * abort when strict.
+ */
+static long
+unrepresentable(struct ctx *ctx, long c, unsigned long lineno)
+{
+    if (!ctx->replacement)
+        die(":<stdin>:%lu: U+%04lX not representable in output",
+            lineno, c);
+    fprintf(stderr, "<stdin>:%lu: U+%04lX not representable\n", lineno, c);
+    stats.replaced++;
+    return ctx->replacement;
+}
+
+/* Write out a completely full output buffer. */
+static void
+drain(union polyctx *to)
+{
+    to->generic.buf -= BUFLEN;
+    to->generic.len = BUFLEN;
+    if (!fwrite(to->generic.buf, BUFLEN, 1, stdout))
+        die(":<stdout>:");
+    stats.bytes_out += BUFLEN;
+    stats.writes++;
+    stats.drains++;
+}
 
 static void
 push(union polyctx *to, encoder encode, long c)
 {
-    while (encode(to, c) == CTX_FULL) {
-        to->generic.buf -= BUFLEN;
-        to->generic.len = BUFLEN;
-        if (!fwrite(to->generic.buf, BUFLEN, 1, stdout))
+    while (encode(to, c) == CTX_FULL)
+        drain(to);
+}
+
+static unsigned long
+count_lines(const char *s, size_t len)
+{
+    unsigned long n = 0;
+    const char *end = s + len;
+    while ((s = memchr(s, 0x0a, end - s))) {
+        n++;
+        s++;
+    }
+    return n;
+}
+
+/* Copy input that would come out of both codecs unchanged directly to
+ * the output, bypassing the codecs entirely. When the output buffer is
+ * empty and the entire input buffer qualifies, it's written straight
+ * from the input buffer. Returns the number of lines copied.
+ */
+static unsigned long
+passthrough(struct ctx *ctx, const char *bo)
+{
+    union polyctx *fr = &ctx->fr;
+    union polyctx *to = &ctx->to;
+    unsigned long lines;
+    size_t n;
+
+    n = ctx->decode_span(fr, fr->generic.buf, fr->generic.len);
+    n = ctx->encode_span(to, fr->generic.buf, n);
+    lines = count_lines(fr->generic.buf, n);
+    if (linemode.on && lines) {
+        /* the copy ends a line at its last newline */
+        size_t i = n;
+        while (fr->generic.buf[--i] != 0x0a);
+        linemode.lines += lines;
+        linemode.in = linemode.skip + stats.bytes_in - fr->generic.len + i + 1;
+        linemode.out = stats.bytes_out + (to->generic.buf - bo) + i + 1;
+    }
+    stats.passed += n;
+    stats.codepoints += n;
+    if (ctx->lenient)
+        ctx->lenient->offset += n;
+
+    if (n && n == fr->generic.len && to->generic.buf == bo) {
+        if (!fwrite(fr->generic.buf, n, 1, stdout))
             die(":<stdout>:");
+        stats.bytes_out += n;
+        stats.writes++;
+        fr->generic.buf += n;
+        fr->generic.len = 0;
+        return lines;
+    }
+
+    while (n) {
+        size_t z = n < to->generic.len ? n : to->generic.len;
+        memcpy(to->generic.buf, fr->generic.buf, z);
+        to->generic.buf += z;
+        to->generic.len -= z;
+        fr->generic.buf += z;
+        fr->generic.len -= z;
+        n -= z;
+        if (!to->generic.len)
+            drain(to);
+    }
+    return lines;
+}
+
+/* Latin-1 to UTF-7 through utf7_encode_latin1(), which only stops
+ * short when the output buffer is full.
+ */
+static long
+bulk_latin1_utf7(struct ctx *ctx, unsigned long *lineno)
+{
+    union polyctx *fr = &ctx->fr;
+    union polyctx *to = &ctx->to;
+    for (;;) {
+        size_t n = utf7_encode_latin1(&to->utf7, fr->generic.buf,
+                                      fr->generic.len);
+        *lineno += count_lines(fr->generic.buf, n);
+        stats.codepoints += n;
+        fr->generic.buf += n;
+        fr->generic.len -= n;
+        if (!fr->generic.len)
+            return CTX_OK;
+        drain(to);
+    }
+}
+
+/* UTF-7 to Latin-1 through utf7_decode_latin1(), handing back anything
+ * else it returns, including code points Latin-1 lacks.
+ */
+static long
+bulk_utf7_latin1(struct ctx *ctx, unsigned long *lineno)
+{
+    union polyctx *fr = &ctx->fr;
+    union polyctx *to = &ctx->to;
+    for (;;) {
+        size_t n = to->generic.len;
+        long c = utf7_decode_latin1(&fr->utf7, to->generic.buf, &n);
+        *lineno += count_lines(to->generic.buf, n);
+        stats.codepoints += n;
+        to->generic.buf += n;
+        to->generic.len -= n;
+        if (c != CTX_FULL)
+            return c;
+        drain(to);
+    }
+}
+
+/* Record a newline just converted as a line boundary for -l. Only a
+ * raw newline byte counts: one spelled in base64 is inside a shifted
+ * segment. The UTF-8 encoder holds back output that didn't fit, so
+ * flush it first: the boundary must fall after the newline itself.
+ */
+static void
+linemode_mark(struct ctx *ctx, const char *bo)
+{
+    push(&ctx->to, ctx->encode, CTX_FLUSH);
+    linemode.lines++;
+    linemode.in = linemode.skip + stats.bytes_in - ctx->fr.generic.len;
+    linemode.out = stats.bytes_out + (ctx->to.generic.buf - bo);
+}
+
+/* On failure, finish writing the output of the complete lines, then
+ * say how to resume.
+ */
+static void
+linemode_report(void)
+{
+    if (linemode.out > stats.bytes_out)
+        fwrite(linemode.bo, linemode.out - stats.bytes_out, 1, stdout);
+    fflush(stdout);
+    fprintf(stderr, "conv7: %lu complete lines, through input byte %lu\n",
+            linemode.lines, linemode.in);
+    fprintf(stderr, "conv7: to resume, keep the first %lu bytes of this "
+            "output and rerun with -l -k %lu\n", linemode.out, linemode.in);
+}
+
+/* Skip the first -k bytes of input, which must end a line. Returns the
+ * number of lines skipped.
+ */
+static unsigned long
+linemode_skip(char *buf, size_t len)
+{
+    unsigned long left = linemode.skip;
+    unsigned long lines = 0;
+    int last = 0x0a;
+    while (left) {
+        size_t n = fread(buf, 1, left < len ? left : len, stdin);
+        if (!n) {
+            if (ferror(stdin))
+                die(":<stdin>:");
+            die("-k %lu is past the end of the input", linemode.skip);
+        }
+        lines += count_lines(buf, n);
+        last = buf[n - 1];
+        left -= n;
     }
+    if (last != 0x0a)
+        die("-k %lu is not at the start of a line", linemode.skip);
+    return lines;
 }
 
 static void
@@ -117,6 +314,7 @@ convert(struct ctx *ctx, enum bom_mode bom)
     char bi[BUFLEN];
     char bo[BUFLEN];
     unsigned long lineno = 1;
+    int scan = 1;
 
     union polyctx *fr = &ctx->fr;
     union polyctx *to = &ctx->to;
@@ -125,19 +323,37 @@ convert(struct ctx *ctx, enum bom_mode bom)
 
     fr->generic.buf = bi;
     fr->generic.len = 0;
+    stats.readlen = sizeof(bi);
 
     to->generic.buf = bo;
     to->generic.len = sizeof(bo);
 
+    if (linemode.on) {
+        lineno += linemode_skip(bi, sizeof(bi));
+        linemode.lines = lineno - 1;
+        linemode.in = linemode.skip;
+        linemode.bo = bo;
+        if (ctx->lenient)
+            ctx->lenient->offset = linemode.skip;
+    }
+
     if (bom == BOM_ADD) {
         push(to, en, BOM);
         bom = BOM_REMOVE;
     }
 
     for (;;) {
-        long c = de(fr);
+        long c;
+        if (scan && bom == BOM_PASS)
+            lineno += passthrough(ctx, bo);
+        if (ctx->bulk && bom == BOM_PASS)
+            c = ctx->bulk(ctx, &lineno);
+        else
+            c = de(fr);
         if (bom == BOM_REMOVE && c == BOM)
             c = de(fr);
+        if (ctx->lenient && ctx->lenient->count)
+            report_errors(ctx->lenient, lineno);
 
         switch (c) {
             case CTX_OK:
@@ -148,13 +364,21 @@ convert(struct ctx *ctx, enum bom_mode bom)
                     fr->generic.len = 0;
                 else
                     fr->generic.len = fread(bi, 1, sizeof(bi), stdin);
+                stats.bytes_in += fr->generic.len;
+                stats.reads++;
                 if (!fr->generic.len) {
                     if (ferror(stdin))
                         die(":<stdin>:%lu:", lineno);
-                    if (c == UTF7_INCOMPLETE)
+                    if (c == UTF7_INCOMPLETE && !ctx->lenient)
                         die(":<stdin>:%lu: truncated input", lineno);
+                    if (c == UTF7_INCOMPLETE) {
+                        fprintf(stderr, "<stdin>:%lu: truncated input\n",
+                                lineno);
+                        push(to, en, ctx->replacement);
+                    }
                     goto finish;
                 }
+                scan = 1;
                 break;
 
             case CTX_INVALID:
@@ -166,55 +390,808 @@ convert(struct ctx *ctx, enum bom_mode bom)
                 lineno++;
                 /* FALLTHROUGH */
             default:
+                if (c > ctx->max)
+                    c = unrepresentable(ctx, c, lineno);
                 push(to, en, c);
+                if (linemode.on && c == 0x0a && fr->generic.buf[-1] == 0x0a)
+                    linemode_mark(ctx, bo);
                 bom = BOM_PASS;
+                scan = c < 0x80;
+                stats.codepoints++;
         }
     }
 
 finish:
     /* flush whatever is left */
     push(to, en, CTX_FLUSH);
-    if (to->generic.buf - bo && !fwrite(bo, to->generic.buf - bo, 1, stdout))
-        die(":<stdout>:%lu:", lineno);
+    if (to->generic.buf - bo) {
+        if (!fwrite(bo, to->generic.buf - bo, 1, stdout))
+            die(":<stdout>:%lu:", lineno);
+        stats.bytes_out += to->generic.buf - bo;
+        stats.writes++;
+    }
     if (fflush(stdout) == EOF)
         die(":<stdout>:%lu:", lineno);
 }
 
+/* mbox mode (-m): stream an mbox archive or a single RFC 5322 message,
+ * transcoding only the text parts labeled charset=utf-7, and RFC 2047
+ * encoded words labeled UTF-7, into UTF-8. Everything else is copied
+ * from the input buffer unchanged. Only headers are ever buffered, so
+ * memory use doesn't depend on the input size.
+ */
+
+#define MBOX_BUFLEN   65536 /* input buffer, and longest line examined */
+#define MBOX_HDRLEN   65536 /* longest header block that is rewritten */
+#define MBOX_DEPTH    16    /* deepest multipart nesting followed */
+#define MBOX_BOUNDARY 70    /* longest boundary, per RFC 2046 */
+
+enum mbox_state {
+    M_HEADER,       /* collecting a header block */
+    M_RAWHEADER,    /* passing an overlong header block */
+    M_PASS,         /* passing a body */
+    M_TRANSCODE     /* converting a UTF-7 body */
+};
+
+static struct mbox {
+    char in[MBOX_BUFLEN];
+    size_t pass;    /* start of pending pass-through bytes */
+    size_t beg;     /* start of unread bytes */
+    size_t end;
+    int bol;        /* the unread bytes begin a line */
+    int blank;      /* the previous line was blank */
+    int mbox;       /* input has "From " separator lines */
+    enum mbox_state state;
+    unsigned long lineno;
+
+    char hbuf[MBOX_HDRLEN];
+    size_t hlen;
+
+    char boundary[MBOX_DEPTH][MBOX_BOUNDARY];
+    size_t blen[MBOX_DEPTH];
+    int depth;
+
+    char out[BUFLEN];   /* transcoder output */
+    size_t olen;
+} mbox;
+
+/* Write out whatever the transcoder has buffered. */
+static void
+mbox_drain(void)
+{
+    if (mbox.olen) {
+        if (!fwrite(mbox.out, mbox.olen, 1, stdout))
+            die(":<stdout>:");
+        stats.bytes_out += mbox.olen;
+        stats.writes++;
+        mbox.olen = 0;
+    }
+}
+
+/* Write output in order after anything the transcoder has buffered. */
+static void
+mbox_emit(const char *s, size_t len)
+{
+    if (len) {
+        mbox_drain();
+        if (!fwrite(s, len, 1, stdout))
+            die(":<stdout>:");
+        stats.bytes_out += len;
+        stats.writes++;
+    }
+}
+
+static void
+mbox_puts(const char *s)
+{
+    mbox_emit(s, strlen(s));
+}
+
+/* Write out the pending pass-through bytes straight from the input. */
+static void
+mbox_flush_run(void)
+{
+    mbox_emit(mbox.in + mbox.pass, mbox.beg - mbox.pass);
+    stats.copied += mbox.beg - mbox.pass;
+    mbox.pass = mbox.beg;
+}
+
+/* Return the next line without consuming it, or null at the end of
+ * input. A line that doesn't fit is returned in buffer sized pieces.
+ */
+static char *
+mbox_next(size_t *len)
+{
+    for (;;) {
+        char *s = mbox.in + mbox.beg;
+        size_t avail = mbox.end - mbox.beg;
+        char *nl = memchr(s, 0x0a, avail);
+        if (nl) {
+            *len = nl - s + 1;
+            return s;
+        }
+        if (avail == sizeof(mbox.in) || (feof(stdin) && avail)) {
+            *len = avail;
+            return s;
+        }
+        if (feof(stdin))
+            return 0;
+
+        /* make room and read more */
+        mbox_flush_run();
+        memmove(mbox.in, s, avail);
+        mbox.pass = mbox.beg = 0;
+        mbox.end = avail;
+        avail = fread(mbox.in + mbox.end, 1, sizeof(mbox.in) - mbox.end,
+                      stdin);
+        if (ferror(stdin))
+            die(":<stdin>:%lu:", mbox.lineno);
+        mbox.end += avail;
+        stats.bytes_in += avail;
+        stats.reads++;
+    }
+}
+
+/* Consume a line, either as part of the pass-through run or not. */
+static void
+mbox_consume(size_t len, int pass)
+{
+    if (!pass)
+        mbox_flush_run();
+    mbox.beg += len;
+    if (!pass)
+        mbox.pass = mbox.beg;
+    mbox.bol = mbox.in[mbox.beg - 1] == 0x0a;
+    mbox.lineno += mbox.bol;
+}
+
 static int
-wrap_utf7_encode(union polyctx *ctx, long c)
+mbox_isblank(const char *s, size_t len)
 {
-    return utf7_encode(&ctx->utf7, c);
+    return (len == 1 && s[0] == 0x0a) ||
+           (len == 2 && s[0] == 0x0d && s[1] == 0x0a);
 }
 
 static int
-wrap_utf8_encode(union polyctx *ctx, long c)
+mbox_lower(int c)
 {
-    return utf8_encode(&ctx->utf8, c);
+    return c >= 0x41 && c <= 0x5a ? c + 0x20 : c;
 }
 
-static long
-wrap_utf7_decode(union polyctx *ctx)
+/* Case-insensitive match of s, of length len, against ASCII name. */
+static int
+mbox_is(const char *s, size_t len, const char *name)
+{
+    size_t i;
+    if (len != strlen(name))
+        return 0;
+    for (i = 0; i < len; i++)
+        if (mbox_lower((unsigned char)s[i]) != name[i])
+            return 0;
+    return 1;
+}
+
+static int
+mbox_isutf7(const char *s, size_t len)
 {
-    return utf7_decode(&ctx->utf7);
+    return mbox_is(s, len, "utf-7") || mbox_is(s, len, "unicode-1-1-utf-7");
 }
 
+static int
+mbox_isspace(int c)
+{
+    return c == 0x20 || c == 0x09 || c == 0x0d || c == 0x0a;
+}
+
+/* Length of the MIME token at the start of s. */
+static size_t
+mbox_token(const char *s, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        int c = (unsigned char)s[i];
+        if (c <= 0x20 || c >= 0x7f || strchr("()<>@,;:\\\"/[]?=", c))
+            break;
+    }
+    return i;
+}
+
+static size_t
+mbox_skip(const char *s, size_t i, size_t len)
+{
+    while (i < len && mbox_isspace((unsigned char)s[i]))
+        i++;
+    return i;
+}
+
+/* What a header block says about the body that follows. */
+struct mbox_entity {
+    int text;
+    int multipart;
+    int message;            /* message/rfc822 */
+    int identity;           /* 7bit, 8bit, binary, or unspecified */
+    int cte_seen;
+    size_t charset[2];      /* charset=utf-7 value, else zeros */
+    size_t cte[2];          /* "7bit" value, else zeros */
+    char boundary[MBOX_BOUNDARY];
+    size_t blen;
+};
+
+/* Parse a Content-Type value at h[i..end). */
+static void
+mbox_content_type(const char *h, size_t i, size_t end,
+                  struct mbox_entity *e)
+{
+    size_t n;
+
+    i = mbox_skip(h, i, end);
+    n = mbox_token(h + i, end - i);
+    e->text = mbox_is(h + i, n, "text");
+    e->multipart = mbox_is(h + i, n, "multipart");
+    e->message = mbox_is(h + i, n, "message");
+    i += n;
+    if (i < end && h[i] == 0x2f) { /* '/' */
+        i++;
+        n = mbox_token(h + i, end - i);
+        e->message &= mbox_is(h + i, n, "rfc822");
+        i += n;
+    }
+
+    /* parameters */
+    for (;;) {
+        size_t name, nlen, v, vlen;
+        i = mbox_skip(h, i, end);
+        if (i == end || h[i] != 0x3b) /* ';' */
+            break;
+        i = mbox_skip(h, i + 1, end);
+        name = i;
+        nlen = mbox_token(h + i, end - i);
+        i = mbox_skip(h, i + nlen, end);
+        if (i == end || h[i] != 0x3d) /* '=' */
+            break;
+        i = mbox_skip(h, i + 1, end);
+        if (i < end && h[i] == 0x22) { /* '"' */
+            v = ++i;
+            while (i < end && h[i] != 0x22)
+                i += (h[i] == 0x5c) + 1; /* '\\' */
+            if (i >= end) /* unterminated */
+                break;
+            vlen = i++ - v;
+        } else {
+            v = i;
+            vlen = mbox_token(h + i, end - i);
+            i += vlen;
+        }
+        if (mbox_is(h + name, nlen, "charset") && mbox_isutf7(h + v, vlen)) {
+            e->charset[0] = v;
+            e->charset[1] = v + vlen;
+        } else if (mbox_is(h + name, nlen, "boundary") &&
+                   vlen && vlen <= MBOX_BOUNDARY) {
+            memcpy(e->boundary, h + v, vlen);
+            e->blen = vlen;
+        }
+    }
+}
+
+/* Parse a Content-Transfer-Encoding value at h[i..end). */
+static void
+mbox_cte(const char *h, size_t i, size_t end, struct mbox_entity *e)
+{
+    size_t n;
+    i = mbox_skip(h, i, end);
+    n = mbox_token(h + i, end - i);
+    e->cte_seen = 1;
+    e->identity = mbox_is(h + i, n, "7bit") || mbox_is(h + i, n, "8bit") ||
+                  mbox_is(h + i, n, "binary");
+    if (mbox_is(h + i, n, "7bit")) {
+        e->cte[0] = i;
+        e->cte[1] = i + n;
+    }
+}
+
+static const char mbox_b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int
+mbox_hex(int c)
+{
+    if (c >= 0x30 && c <= 0x39)
+        return c - 0x30;
+    c = mbox_lower(c);
+    return c >= 0x61 && c <= 0x66 ? c - 0x61 + 10 : -1;
+}
+
+/* Decode the text of a B or Q encoded word, or return -1. */
 static long
-wrap_utf8_decode(union polyctx *ctx)
+mbox_word_decode(char *dst, const char *s, size_t len, int q)
 {
-    return utf8_decode(&ctx->utf8);
+    size_t i, n = 0;
+    unsigned long accum = 0;
+    int bits = 0;
+    for (i = 0; i < len; i++) {
+        int c = (unsigned char)s[i];
+        if (q) {
+            if (c == 0x5f) { /* '_' */
+                dst[n++] = 0x20;
+            } else if (c == 0x3d) { /* '=' */
+                int hi, lo;
+                if (i + 2 >= len)
+                    return -1;
+                hi = mbox_hex((unsigned char)s[i + 1]);
+                lo = mbox_hex((unsigned char)s[i + 2]);
+                if (hi < 0 || lo < 0)
+                    return -1;
+                dst[n++] = hi << 4 | lo;
+                i += 2;
+            } else {
+                dst[n++] = c;
+            }
+        } else if (c != 0x3d) {
+            const char *p = c ? strchr(mbox_b64, c) : 0;
+            if (!p)
+                return -1;
+            accum = (accum << 6 | (p - mbox_b64)) & 0xffffUL;
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                dst[n++] = accum >> bits & 0xff;
+            }
+        }
+    }
+    return (long)n;
+}
+
+/* Write s in B or Q encoding. */
+static void
+mbox_word_encode(const unsigned char *s, size_t len, int q)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char buf[4];
+    size_t i;
+    if (!q) {
+        for (i = 0; i < len; i += 3) {
+            size_t n = len - i < 3 ? len - i : 3;
+            unsigned long v = (unsigned long)s[i] << 16;
+            if (n > 1)
+                v |= (unsigned long)s[i + 1] << 8;
+            if (n > 2)
+                v |= s[i + 2];
+            buf[0] = mbox_b64[v >> 18 & 0x3f];
+            buf[1] = mbox_b64[v >> 12 & 0x3f];
+            buf[2] = n > 1 ? mbox_b64[v >> 6 & 0x3f] : 0x3d;
+            buf[3] = n > 2 ? mbox_b64[v & 0x3f] : 0x3d;
+            mbox_emit(buf, 4);
+        }
+        return;
+    }
+    for (i = 0; i < len; i++) {
+        int c = s[i];
+        if (c == 0x20) {
+            mbox_puts("_");
+        } else if ((c >= 0x30 && c <= 0x39) ||
+                   (mbox_lower(c) >= 0x61 && mbox_lower(c) <= 0x7a) ||
+                   strchr("!*+-/", c)) {
+            buf[0] = c;
+            mbox_emit(buf, 1);
+        } else {
+            buf[0] = 0x3d;
+            buf[1] = hex[c >> 4];
+            buf[2] = hex[c & 15];
+            mbox_emit(buf, 3);
+        }
+    }
+}
+
+/* If s begins with a UTF-7 encoded word, write it in UTF-8 and return
+ * its length. Otherwise, including when it doesn't decode, return 0.
+ */
+static size_t
+mbox_word(const char *s, size_t len)
+{
+    static char raw[MBOX_HDRLEN];
+    static char u8[MBOX_HDRLEN * 3 / 2 + 8];
+    size_t cs, lang, text, end;
+    struct utf7 dec;
+    struct utf8 enc;
+    long n, c;
+    int q;
+
+    /* =?charset*lang?X?text?= */
+    for (cs = 2; cs < len && s[cs] != 0x3f; cs++)
+        if (mbox_isspace((unsigned char)s[cs]))
+            return 0;
+    if (cs + 3 > len || s[cs + 2] != 0x3f)
+        return 0;
+    for (lang = 2; lang < cs && s[lang] != 0x2a; lang++)
+        ;
+    if (!mbox_isutf7(s + 2, lang - 2))
+        return 0;
+    q = mbox_lower((unsigned char)s[cs + 1]);
+    if (q != 0x62 && q != 0x71) /* 'b' or 'q' */
+        return 0;
+    q = q == 0x71;
+    text = cs + 3;
+    for (end = text; end + 1 < len; end++) {
+        if (mbox_isspace((unsigned char)s[end]))
+            return 0;
+        if (s[end] == 0x3f && s[end + 1] == 0x3d)
+            break;
+    }
+    if (end + 1 >= len)
+        return 0;
+
+    n = mbox_word_decode(raw, s + text, end - text, q);
+    if (n < 0)
+        return 0;
+    utf7_init(&dec, 0);
+    dec.buf = raw;
+    dec.len = n;
+    utf8_init(&enc);
+    enc.buf = u8;
+    enc.len = sizeof(u8);
+    while ((c = utf7_decode(&dec)) >= 0)
+        utf8_encode(&enc, c);
+    if (c != UTF7_OK)
+        return 0;
+
+    mbox_puts("=?UTF-8");
+    mbox_emit(s + lang, cs - lang);
+    mbox_puts(q ? "?Q?" : "?B?");
+    mbox_word_encode((unsigned char *)u8, enc.buf - u8, q);
+    mbox_puts("?=");
+    return end + 2;
+}
+
+/* Encode a code point into the transcoder output. */
+static void
+mbox_put(struct ctx *ctx, long c)
+{
+    struct utf8 *to = &ctx->to.utf8;
+    to->buf = mbox.out + mbox.olen;
+    to->len = sizeof(mbox.out) - mbox.olen;
+    while (utf8_encode(to, c) == UTF8_FULL) {
+        mbox.olen = sizeof(mbox.out);
+        mbox_drain();
+        to->buf = mbox.out;
+        to->len = sizeof(mbox.out);
+    }
+    mbox.olen = to->buf - mbox.out;
+}
+
+static void
+mbox_transcode_start(struct ctx *ctx)
+{
+    static const struct utf7_state zero = {{0, 0}, 0, 0};
+    struct utf7_set set;
+    utf7_set_init(&set, 0);
+    utf7_load(&ctx->fr.utf7, &set, &zero);
+    if (ctx->lenient)
+        ctx->lenient->pending = -1;
+}
+
+/* Finish a UTF-7 body at a delimiter or the end of input. */
+static void
+mbox_transcode_end(struct ctx *ctx)
+{
+    long c;
+    if (mbox.state != M_TRANSCODE)
+        return;
+    ctx->fr.utf7.len = 0;
+    while ((c = utf7_decode(&ctx->fr.utf7)) >= 0)
+        mbox_put(ctx, c);
+    if (c == UTF7_INCOMPLETE) {
+        if (!ctx->lenient)
+            die(":<stdin>:%lu: truncated input", mbox.lineno);
+        fprintf(stderr, "<stdin>:%lu: truncated input\n", mbox.lineno);
+        mbox_put(ctx, REPLACEMENT);
+    }
+}
+
+/* Rewrite and write out the collected header block, and decide how to
+ * handle the body that follows.
+ */
+static void
+mbox_headers(struct ctx *ctx)
+{
+    const char *h = mbox.hbuf;
+    size_t len = mbox.hlen;
+    size_t blank, i, run, f;
+    struct mbox_entity e;
+    int transcode;
+
+    memset(&e, 0, sizeof(e));
+    e.identity = 1;
+
+    /* the last line is the blank one */
+    blank = len - 1;
+    while (blank && h[blank - 1] != 0x0a)
+        blank--;
+
+    /* find the fields that matter */
+    for (f = 0; f < blank; ) {
+        size_t colon, end = f;
+        do {
+            const char *nl = memchr(h + end, 0x0a, blank - end);
+            end = nl ? (size_t)(nl - h) + 1 : blank;
+        } while (end < blank && (h[end] == 0x20 || h[end] == 0x09));
+        for (colon = f; colon < end && h[colon] != 0x3a; colon++)
+            ;
+        if (colon < end) {
+            if (mbox_is(h + f, colon - f, "content-type"))
+                mbox_content_type(h, colon + 1, end, &e);
+            else if (mbox_is(h + f, colon - f, "content-transfer-encoding"))
+                mbox_cte(h, colon + 1, end, &e);
+        }
+        f = end;
+    }
+    transcode = e.text && e.charset[1] && e.identity;
+
+    /* write it back out with the changes */
+    for (i = run = 0; i < blank; ) {
+        size_t n = 0;
+        const char *rep = 0;
+        if (transcode && i == e.charset[0]) {
+            rep = "utf-8";
+            n = e.charset[1] - i;
+        } else if (transcode && e.cte[1] && i == e.cte[0]) {
+            rep = "8bit";
+            n = e.cte[1] - i;
+        }
+        if (rep) {
+            mbox_emit(h + run, i - run);
+            mbox_puts(rep);
+        } else if (h[i] == 0x3d && i + 1 < blank && h[i + 1] == 0x3f) {
+            mbox_emit(h + run, i - run);
+            n = mbox_word(h + i, blank - i);
+            if (!n)
+                run = i;
+        }
+        if (n) {
+            i += n;
+            run = i;
+        } else {
+            i++;
+        }
+    }
+    mbox_emit(h + run, blank - run);
+    if (transcode && !e.cte_seen) {
+        mbox_puts("Content-Transfer-Encoding: 8bit");
+        mbox_emit(h + blank, len - blank);
+    }
+    mbox_emit(h + blank, len - blank);
+    mbox.hlen = 0;
+
+    if (e.multipart && e.blen && mbox.depth < MBOX_DEPTH) {
+        memcpy(mbox.boundary[mbox.depth], e.boundary, e.blen);
+        mbox.blen[mbox.depth++] = e.blen;
+        mbox.state = M_PASS;
+    } else if (e.message && e.identity) {
+        mbox.state = M_HEADER;
+    } else if (transcode) {
+        mbox.state = M_TRANSCODE;
+        mbox_transcode_start(ctx);
+    } else {
+        mbox.state = M_PASS;
+    }
+}
+
+/* Is this line a delimiter for an open multipart? If so, close any
+ * parts inside it and return 1 for a part delimiter, 2 for the close
+ * delimiter.
+ */
+static int
+mbox_delimiter(const char *s, size_t len)
+{
+    int d;
+    if (len < 2 || s[0] != 0x2d || s[1] != 0x2d)
+        return 0;
+    for (d = mbox.depth - 1; d >= 0; d--) {
+        size_t i, n = mbox.blen[d];
+        int close = 0;
+        if (len < n + 2 || memcmp(s + 2, mbox.boundary[d], n))
+            continue;
+        i = n + 2;
+        if (i + 1 < len && s[i] == 0x2d && s[i + 1] == 0x2d) {
+            close = 1;
+            i += 2;
+        }
+        while (i < len && mbox_isspace((unsigned char)s[i]))
+            i++;
+        if (i < len)
+            continue;
+        mbox.depth = d + !close;
+        return 1 + close;
+    }
+    return 0;
+}
+
+/* Convert one line of a UTF-7 body into the output buffer. */
+static void
+mbox_transcode(struct ctx *ctx, char *s, size_t len)
+{
+    struct utf7 *fr = &ctx->fr.utf7;
+    fr->buf = s;
+    fr->len = len;
+    for (;;) {
+        long c;
+        size_t n = utf7_decode_span(fr, fr->buf, fr->len);
+        if (n) {
+            if (sizeof(mbox.out) - mbox.olen < n)
+                mbox_drain();
+            if (n > sizeof(mbox.out)) {
+                mbox_emit(fr->buf, n);
+            } else {
+                memcpy(mbox.out + mbox.olen, fr->buf, n);
+                mbox.olen += n;
+            }
+            fr->buf += n;
+            fr->len -= n;
+            stats.passed += n;
+            stats.codepoints += n;
+            if (ctx->lenient)
+                ctx->lenient->offset += n;
+        }
+        c = utf7_decode(fr);
+        if (ctx->lenient && ctx->lenient->count)
+            report_errors(ctx->lenient, mbox.lineno);
+        if (c == UTF7_INVALID)
+            die(":<stdin>:%lu: invalid input", mbox.lineno);
+        if (c < 0)
+            break;
+        mbox_put(ctx, c);
+        stats.codepoints++;
+    }
+}
+
+static void
+convert_mbox(struct ctx *ctx)
+{
+    char *s;
+    size_t len;
+
+    stats.readlen = sizeof(mbox.in);
+    mbox.bol = mbox.blank = 1;
+    mbox.lineno = 1;
+    mbox.state = M_HEADER;
+    while ((s = mbox_next(&len))) {
+        int bol = mbox.bol;
+        int blank = bol && mbox_isblank(s, len);
+        int from = bol && len >= 5 && !memcmp(s, "From ", 5);
+        int delim;
+
+        if (from && mbox.lineno == 1)
+            mbox.mbox = 1;
+        if (from && mbox.mbox && mbox.blank) {
+            /* a new message */
+            mbox_transcode_end(ctx);
+            if (mbox.state == M_HEADER && mbox.hlen) {
+                mbox_emit(mbox.hbuf, mbox.hlen);
+                mbox.hlen = 0;
+            }
+            mbox.depth = 0;
+            mbox.state = M_HEADER;
+            mbox_consume(len, 1);
+
+        } else if (mbox.state == M_HEADER) {
+            if (!bol || mbox.hlen + len > sizeof(mbox.hbuf)) {
+                /* too long to rewrite, so pass it all */
+                mbox_emit(mbox.hbuf, mbox.hlen);
+                mbox.hlen = 0;
+                mbox.state = blank ? M_PASS : M_RAWHEADER;
+                mbox_consume(len, 1);
+            } else {
+                memcpy(mbox.hbuf + mbox.hlen, s, len);
+                mbox.hlen += len;
+                mbox_consume(len, 0);
+                if (blank)
+                    mbox_headers(ctx);
+            }
+
+        } else if (mbox.state == M_RAWHEADER) {
+            if (blank)
+                mbox.state = M_PASS;
+            mbox_consume(len, 1);
+
+        } else if (bol && (delim = mbox_delimiter(s, len))) {
+            /* headers follow a part delimiter, an epilogue the close */
+            mbox_transcode_end(ctx);
+            mbox.state = delim == 1 ? M_HEADER : M_PASS;
+            mbox_consume(len, 1);
+
+        } else if (mbox.state == M_TRANSCODE) {
+            mbox_flush_run();
+            mbox_transcode(ctx, s, len);
+            mbox_consume(len, 0);
+
+        } else {
+            mbox_consume(len, 1);
+        }
+        mbox.blank = blank;
+    }
+
+    mbox_transcode_end(ctx);
+    if (mbox.hlen)
+        mbox_emit(mbox.hbuf, mbox.hlen);
+    mbox_flush_run();
+    mbox_drain();
+    if (fflush(stdout) == EOF)
+        die(":<stdout>:%lu:", mbox.lineno);
+}
+
+/* Describe the traffic through one UTF-7 context. The bytes copied by
+ * passthrough() never reach the codec, so they're added in as direct.
+ */
+static void
+report_utf7(const char *side, const struct utf7 *ctx)
+{
+    struct utf7_stats s;
+    double direct, total;
+
+    utf7_stats(ctx, &s);
+    direct = (double)s.direct + stats.passed;
+    total = direct + s.base64 + s.dashes + 2.0 * s.escapes + s.opened;
+    if (!total)
+        total = 1;
+    fprintf(stderr, "conv7: %s direct      %.1f%%\n", side,
+            100 * direct / total);
+    fprintf(stderr, "conv7: %s base64      %.1f%% (+ %.1f%% shifts)\n",
+            side, 100 * s.base64 / total,
+            100 * (s.dashes + 2.0 * s.escapes + s.opened) / total);
+    fprintf(stderr, "conv7: %s segments    %lu, mean %.1f chars\n",
+            side, s.opened, s.opened ? (double)s.base64 / s.opened : 0);
+    fprintf(stderr, "conv7: %s escapes     %lu\n", side, s.escapes);
+    fprintf(stderr, "conv7: %s surrogates  %lu\n", side, s.surrogates);
+}
+
+/* Print the -s report to standard error. */
+static void
+report(struct ctx *ctx, enum encoding fr, enum encoding to,
+       clock_t cpu, time_t wall)
+{
+    double secs = (double)(clock() - cpu) / CLOCKS_PER_SEC;
+    double mbs = secs > 0 ? stats.bytes_in / secs / 1e6 : 0;
+
+    fprintf(stderr, "conv7: bytes in          %lu\n", stats.bytes_in);
+    fprintf(stderr, "conv7: bytes out         %lu\n", stats.bytes_out);
+    fprintf(stderr, "conv7: code points       %lu\n", stats.codepoints);
+    fprintf(stderr, "conv7: passed through    %lu bytes\n", stats.passed);
+    if (stats.copied)
+        fprintf(stderr, "conv7: copied unchanged  %lu bytes\n",
+                stats.copied);
+    if (stats.replaced)
+        fprintf(stderr, "conv7: unrepresentable   %lu\n", stats.replaced);
+    fprintf(stderr, "conv7: cpu time          %.3f s\n", secs);
+    fprintf(stderr, "conv7: wall time         %.0f s\n",
+            difftime(time(0), wall));
+    fprintf(stderr, "conv7: throughput        %.1f MB/s\n", mbs);
+    fprintf(stderr, "conv7: reads             %lu x %lu bytes\n",
+            stats.reads, stats.readlen);
+    fprintf(stderr, "conv7: writes            %lu (%lu full buffers)\n",
+            stats.writes, stats.drains);
+    if (fr == F_UTF7)
+        report_utf7("utf-7 in ", &ctx->fr.utf7);
+    if (to == F_UTF7)
+        report_utf7("utf-7 out", &ctx->to.utf7);
 }
 
 static void
 usage(FILE *f)
 {
-    fprintf(f, "usage: conv7 -bch [-e SET] [-f FMT] [-t FMT]\n");
+    fprintf(f, "usage: conv7 -bchlmrs [-e SET] [-f FMT] [-k OFFSET] "
+            "[-t FMT]\n");
     fprintf(f, "  -b        add a BOM if necessary\n");
     fprintf(f, "  -c        clear a BOM if present\n");
     fprintf(f, "  -e SET    extra indirect characters (UTF-7)\n");
     fprintf(f, "  -f FMT    input encoding [utf-7]\n");
     fprintf(f, "  -h        print help info [utf-7]\n");
+    fprintf(f, "  -k OFFSET with -l, resume at this input byte offset\n");
+    fprintf(f, "  -l        line-independent mode, restartable per line\n");
+    fprintf(f, "  -m        mbox/MIME: convert only UTF-7 parts to UTF-8\n");
+    fprintf(f, "  -r        replace invalid input with U+FFFD (UTF-7),\n");
+    fprintf(f, "            and code points missing from the output\n");
+    fprintf(f, "  -s        print statistics to standard error\n");
     fprintf(f, "  -t SET    output encoding\n");
-    fprintf(f, "Supported encodings: utf-7, utf-8\n");
+    fprintf(f, "Supported encodings: utf-7, utf-8, latin-1\n");
 }
 
 static void
@@ -239,12 +1216,20 @@ main(int argc, char **argv)
 {
     enum bom_mode bom = BOM_PASS;
     enum encoding fr = F_UTF7;
-    enum encoding to = F_UTF7;
+    enum encoding to = F_UNKNOWN;
     const char *indirect = 0;
+    int print_stats = 0;
+    int lenient = 0;
+    int mime = 0;
+    char *end;
+    struct utf7_lenient l;
+    struct utf7_error errors[4];
+    clock_t cpu = clock();
+    time_t wall = time(0);
     struct ctx ctx;
 
     int option;
-    while ((option = getopt(argc, argv, "bce:f:ht:")) != -1) {
+    while ((option = getopt(argc, argv, "bce:f:hk:lmrst:")) != -1) {
         switch (option) {
             case 'b':
                 bom = BOM_ADD;
@@ -264,6 +1249,23 @@ main(int argc, char **argv)
                 usage(stdout);
                 exit(EXIT_SUCCESS);
                 break;
+            case 'k':
+                linemode.skip = strtoul(optarg, &end, 10);
+                if (end == optarg || *end)
+                    die("invalid offset, '%s'", optarg);
+                break;
+            case 'l':
+                linemode.on = 1;
+                break;
+            case 'm':
+                mime = 1;
+                break;
+            case 'r':
+                lenient = 1;
+                break;
+            case 's':
+                print_stats = 1;
+                break;
             case 't':
                 to = encoding_parse(optarg);
                 if (!to)
@@ -277,22 +1279,57 @@ main(int argc, char **argv)
 
     if (argv[optind])
         die("unknown command line argument, '%s'", argv[optind]);
+    if (!to)
+        to = mime ? F_UTF8 : F_UTF7;
+    if (mime && (fr != F_UTF7 || to != F_UTF8 || bom != BOM_PASS))
+        die("-m only converts UTF-7 to UTF-8, without BOM options");
+    if (to == F_LATIN1 && bom == BOM_ADD)
+        die("Latin-1 has no BOM");
+    if (linemode.skip && !linemode.on)
+        die("-k only applies with -l");
+    if (linemode.on && (mime || bom != BOM_PASS))
+        die("-l can't be combined with -m, -b, or -c");
+    if (linemode.on && to == F_UTF7 && indirect && strchr(indirect, 0x0a))
+        die("-l needs newlines to be direct, but -e makes them indirect");
 
     /* Switch stdin/stdout to binary if necessary */
     set_binary_mode();
 
+    ctx.bulk = 0;
+    ctx.lenient = 0;
+    ctx.max = to == F_LATIN1 ? 0xff : 0x10ffff;
+    ctx.replacement = 0;
+    if (lenient)
+        ctx.replacement = to == F_LATIN1 ? 0x3f : REPLACEMENT;
+
     switch (fr) {
         case F_UNKNOWN:
             abort();
             break;
         case F_UTF7:
             ctx.decode = wrap_utf7_decode;
+            ctx.decode_span = wrap_utf7_decode_span;
             utf7_init(&ctx.fr.utf7, 0);
+            if (lenient) {
+                utf7_lenient(&ctx.fr.utf7, &l, ctx.replacement,
+                             errors, sizeof(errors) / sizeof(*errors));
+                ctx.lenient = &l;
+            } else if (to == F_LATIN1) {
+                /* lenient errors are reported one at a time */
+                ctx.bulk = bulk_utf7_latin1;
+            }
             break;
         case F_UTF8:
             ctx.decode = wrap_utf8_decode;
+            ctx.decode_span = wrap_utf8_decode_span;
             utf8_init(&ctx.fr.utf8);
             break;
+        case F_LATIN1:
+            ctx.decode = wrap_latin1_decode;
+            ctx.decode_span = wrap_latin1_span;
+            if (to == F_UTF7)
+                ctx.bulk = bulk_latin1_utf7;
+            break;
     }
 
     switch (to) {
@@ -301,14 +1338,29 @@ main(int argc, char **argv)
             break;
         case F_UTF7:
             ctx.encode = wrap_utf7_encode;
+            ctx.encode_span = wrap_utf7_encode_span;
             utf7_init(&ctx.to.utf7, indirect);
             break;
         case F_UTF8:
             ctx.encode = wrap_utf8_encode;
+            ctx.encode_span = wrap_utf8_encode_span;
             utf8_init(&ctx.to.utf8);
             break;
+        case F_LATIN1:
+            ctx.encode = wrap_latin1_encode;
+            ctx.encode_span = wrap_latin1_span;
+            break;
     }
 
-    convert(&ctx, bom);
+    /* the bulk paths don't report where lines end */
+    if (linemode.on)
+        ctx.bulk = 0;
+
+    if (mime)
+        convert_mbox(&ctx);
+    else
+        convert(&ctx, bom);
+    if (print_stats)
+        report(&ctx, fr, to, cpu, wall);
     return 0;
 }
@@ -0,0 +1,64 @@
+#!/bin/sh
+# End-to-end checks for conv7 that need whole inputs and outputs
+# This is free and unencumbered software released into the public domain.
+#
+# Usage: tests/conv7.sh [path/to/conv7]
+
+conv7=${1:-tests/conv7}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+fails=0
+
+pass() {
+    printf '\033[32;1mPASS\033[0m: %s\n' "$1"
+}
+
+fail() {
+    printf '\033[31;1mFAIL\033[0m: %s\n' "$1"
+    fails=$((fails + 1))
+}
+
+# check NAME EXPECT ACTUAL
+check() {
+    if cmp -s "$2" "$3"; then
+        pass "$1"
+    else
+        fail "$1"
+    fi
+}
+
+# A quoted parameter left open must not run into the next field, here
+# one that would otherwise read as a charset=utf-7 parameter.
+printf '%s\n' 'Content-Type: text/plain; charset="utf-7' \
+    'X;charset=utf-7' '' '+AOk-' >"$tmp/in"
+"$conv7" -m <"$tmp/in" >"$tmp/out"
+check "mbox unterminated quoted parameter" "$tmp/in" "$tmp/out"
+
+printf '%s\n' 'Content-Type: text/plain; charset="utf-7\' \
+    'X;charset=utf-7' '' '+AOk-' >"$tmp/in"
+"$conv7" -m <"$tmp/in" >"$tmp/out"
+check "mbox quoted parameter ending in a backslash" "$tmp/in" "$tmp/out"
+
+# -l with -t utf-8: "+AOk-" fills the output buffer exactly, so the
+# encoder holds back the newline after it. The resume point reported
+# when line 2 fails must still include that newline, and the kept
+# output plus a resumed run must match a single run.
+{
+    head -c 4094 /dev/zero | tr '\000' a
+    printf '+AOk-\nx\200y\ntail\n'
+} >"$tmp/in"
+"$conv7" -l -r -f utf-7 -t utf-8 <"$tmp/in" >"$tmp/expect" 2>/dev/null
+"$conv7" -l -f utf-7 -t utf-8 <"$tmp/in" >"$tmp/out" 2>"$tmp/err"
+resume=$(sed -n 's/.*first \([0-9]*\) bytes.*-k \([0-9]*\)$/\1 \2/p' \
+    "$tmp/err")
+if [ "$resume" = "4097 4100" ]; then
+    head -c 4097 "$tmp/out" >"$tmp/kept"
+    "$conv7" -l -r -k 4100 -f utf-7 -t utf-8 <"$tmp/in" >>"$tmp/kept" \
+        2>/dev/null
+    check "-l resume after a newline held by the encoder" \
+        "$tmp/expect" "$tmp/kept"
+else
+    fail "-l resume after a newline held by the encoder"
+fi
+
+test $fails -eq 0
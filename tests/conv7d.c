@@ -0,0 +1,729 @@
+/* Transcoding daemon: many concurrent conv7 streams over a Unix socket
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Unlike the other tools this one is not portable ANSI C. It needs
+ * POSIX threads and sockets, and Linux epoll.
+ *
+ * Protocol, one conversion per connection:
+ *
+ *   client: FROM TO [-r] LF, then the input, then shutdown(SHUT_WR)
+ *   server: frames of a 4-byte big endian length and that many bytes
+ *           of output, then a zero length frame and a status line:
+ *           "ok" or "error: ..."
+ *
+ * A connection opened with "stats" LF instead receives a single frame
+ * of counters, including latency percentiles, followed by "ok".
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "utf8.h"
+#include "polyctx.h"
+#include "../utf7.h"
+
+#define BUFLEN   16384  /* pooled I/O buffer */
+#define HDRLEN   64     /* longest request header */
+#define TRAILER  (4 + HDRLEN)   /* end frame and status line */
+#define POOLMAX  1024   /* idle buffers kept for reuse */
+#define NBUCKET  128    /* latency histogram buckets */
+
+enum conn_state {
+    C_HEADER,   /* waiting for the request line */
+    C_STREAM,   /* converting input as it arrives */
+    C_EOF,      /* input done, output still being finished */
+    C_CLOSING   /* status queued, close once it's written */
+};
+
+/* One client connection and its conversion. The codec contexts live
+ * here for the whole stream, so state such as a half-decoded UTF-7
+ * segment survives between reads. The I/O buffers are borrowed from
+ * the pool only while there's something in them.
+ */
+struct conn {
+    int fd;
+    enum conn_state state;
+    char *in;
+    char *out;
+    size_t olen;        /* bytes queued in out */
+    size_t owrite;      /* bytes of those already written */
+
+    union polyctx fr;
+    union polyctx to;
+    encoder encode;
+    decoder decode;
+    spanner encode_span;
+    spanner decode_span;
+    struct utf7_lenient lenient;
+    long replacement;   /* zero when strict */
+    long max;           /* largest code point out */
+    long pending;       /* code point waiting for output room */
+    int has_pending;
+    int failed;         /* the status line is an error */
+    unsigned long lineno;
+
+    char header[HDRLEN];
+    size_t hlen;
+
+    struct timespec start;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+};
+
+/* Server-wide counters, guarded by a mutex and only touched once per
+ * connection, so contention stays low.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct timespec start;
+    unsigned long accepted;
+    unsigned long active;
+    unsigned long ok;
+    unsigned long failed;
+    unsigned long dropped;      /* closed before finishing */
+    double bytes_in;
+    double bytes_out;
+    unsigned long latency[NBUCKET];
+} stats;
+
+static struct {
+    pthread_mutex_t lock;
+    char *free[POOLMAX];
+    int nfree;
+    unsigned long allocated;
+    unsigned long in_use;
+} pool;
+
+static int epfd;
+static int listenfd;
+
+static void
+die(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "conv7d: ");
+    vfprintf(stderr, fmt, ap);
+    if (fmt[strlen(fmt) - 1] == ':')
+        fprintf(stderr, " %s\n", strerror(errno));
+    else
+        fputc('\n', stderr);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+static char *
+pool_get(void)
+{
+    char *buf = 0;
+    pthread_mutex_lock(&pool.lock);
+    if (pool.nfree)
+        buf = pool.free[--pool.nfree];
+    else
+        pool.allocated++;
+    pool.in_use++;
+    pthread_mutex_unlock(&pool.lock);
+    if (!buf && !(buf = malloc(BUFLEN)))
+        die("out of memory");
+    return buf;
+}
+
+static void
+pool_put(char *buf)
+{
+    if (!buf)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    pool.in_use--;
+    if (pool.nfree < POOLMAX) {
+        pool.free[pool.nfree++] = buf;
+        buf = 0;
+    } else {
+        pool.allocated--;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    free(buf);
+}
+
+static double
+elapsed(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - since->tv_sec) +
+           (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* Log-scaled buckets, four per power of two of microseconds. */
+static int
+bucket(double secs)
+{
+    unsigned long us = (unsigned long)(secs * 1e6);
+    int b = 0;
+    if (us < 4)
+        return (int)us;
+    while (us >> (b + 1))
+        b++;
+    b = b * 4 + (int)((us >> (b - 2)) & 3);
+    return b < NBUCKET ? b : NBUCKET - 1;
+}
+
+static unsigned long
+bucket_floor(int b)
+{
+    if (b < 4)
+        return b;
+    return (4UL | (b & 3)) << (b / 4 - 2);
+}
+
+/* The lower bound of the bucket holding the given fraction. */
+static unsigned long
+percentile(const unsigned long *hist, double p)
+{
+    unsigned long total = 0, seen = 0;
+    int b;
+    for (b = 0; b < NBUCKET; b++)
+        total += hist[b];
+    for (b = 0; b < NBUCKET; b++) {
+        seen += hist[b];
+        if (total && seen >= p * total)
+            return bucket_floor(b);
+    }
+    return 0;
+}
+
+static void
+arm(struct conn *c, unsigned events)
+{
+    struct epoll_event e;
+    e.events = events | EPOLLONESHOT;
+    e.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &e))
+        die("epoll_ctl:");
+}
+
+static void
+conn_close(struct conn *c)
+{
+    double secs = elapsed(&c->start);
+    pthread_mutex_lock(&stats.lock);
+    stats.active--;
+    stats.bytes_in += c->bytes_in;
+    stats.bytes_out += c->bytes_out;
+    if (c->state != C_CLOSING || c->owrite < c->olen) {
+        stats.dropped++;
+    } else {
+        if (c->failed)
+            stats.failed++;
+        else
+            stats.ok++;
+        stats.latency[bucket(secs)]++;
+    }
+    pthread_mutex_unlock(&stats.lock);
+    close(c->fd);
+    pool_put(c->in);
+    pool_put(c->out);
+    free(c);
+}
+
+static void
+put_length(char *p, size_t n)
+{
+    p[0] = (char)(n >> 24 & 0xff);
+    p[1] = (char)(n >> 16 & 0xff);
+    p[2] = (char)(n >>  8 & 0xff);
+    p[3] = (char)(n >>  0 & 0xff);
+}
+
+/* Queue the end frame and status line after any framed output, and
+ * stop converting.
+ */
+static void
+finish(struct conn *c, const char *fmt, ...)
+{
+    va_list ap;
+    char *p = c->out + c->olen;
+    int n;
+    va_start(ap, fmt);
+    n = vsprintf(p + 4, fmt, ap);
+    va_end(ap);
+    put_length(p, 0);
+    c->olen += 4 + n;
+    c->failed = *fmt != 0x6f;   /* 'o' */
+    c->state = C_CLOSING;
+}
+
+static int
+request(struct conn *c, const char *line)
+{
+    char fr[16], to[16], opt[4];
+    enum encoding efr, eto;
+    int n = sscanf(line, "%15s %15s %3s", fr, to, opt);
+
+    if (n < 2 || (n == 3 && strcmp(opt, "-r")))
+        return 0;
+    efr = encoding_parse(fr);
+    eto = encoding_parse(to);
+    if (!efr || !eto)
+        return 0;
+
+    c->max = eto == F_LATIN1 ? 0xff : 0x10ffff;
+    c->replacement = 0;
+    if (n == 3)
+        c->replacement = eto == F_LATIN1 ? 0x3f : REPLACEMENT;
+
+    switch (efr) {
+        case F_UNKNOWN:
+            abort();
+            break;
+        case F_UTF7:
+            c->decode = wrap_utf7_decode;
+            c->decode_span = wrap_utf7_decode_span;
+            utf7_init(&c->fr.utf7, 0);
+            if (c->replacement)
+                utf7_lenient(&c->fr.utf7, &c->lenient, c->replacement,
+                             0, 0);
+            break;
+        case F_UTF8:
+            c->decode = wrap_utf8_decode;
+            c->decode_span = wrap_utf8_decode_span;
+            utf8_init(&c->fr.utf8);
+            break;
+        case F_LATIN1:
+            c->decode = wrap_latin1_decode;
+            c->decode_span = wrap_latin1_span;
+            break;
+    }
+    switch (eto) {
+        case F_UNKNOWN:
+            abort();
+            break;
+        case F_UTF7:
+            c->encode = wrap_utf7_encode;
+            c->encode_span = wrap_utf7_encode_span;
+            utf7_init(&c->to.utf7, 0);
+            break;
+        case F_UTF8:
+            c->encode = wrap_utf8_encode;
+            c->encode_span = wrap_utf8_encode_span;
+            utf8_init(&c->to.utf8);
+            break;
+        case F_LATIN1:
+            c->encode = wrap_latin1_encode;
+            c->encode_span = wrap_latin1_span;
+            break;
+    }
+    return 1;
+}
+
+/* Write the counters as the single data frame of a stats reply. */
+static void
+report(struct conn *c)
+{
+    unsigned long hist[NBUCKET];
+    double secs, in, out;
+    unsigned long accepted, active, ok, failed, dropped;
+    unsigned long allocated, in_use;
+    char *p = c->out + 4;
+    int n;
+
+    pthread_mutex_lock(&stats.lock);
+    memcpy(hist, stats.latency, sizeof(hist));
+    secs = elapsed(&stats.start);
+    in = stats.bytes_in;
+    out = stats.bytes_out;
+    accepted = stats.accepted;
+    active = stats.active;
+    ok = stats.ok;
+    failed = stats.failed;
+    dropped = stats.dropped;
+    pthread_mutex_unlock(&stats.lock);
+    pthread_mutex_lock(&pool.lock);
+    allocated = pool.allocated;
+    in_use = pool.in_use;
+    pthread_mutex_unlock(&pool.lock);
+
+    n = sprintf(p,
+        "uptime       %.1f s\n"
+        "connections  %lu (%lu active)\n"
+        "conversions  %lu ok, %lu failed, %lu dropped\n"
+        "bytes in     %.0f\n"
+        "bytes out    %.0f\n"
+        "throughput   %.2f MB/s in\n"
+        "latency p50  %lu us\n"
+        "latency p99  %lu us\n"
+        "buffers      %lu allocated, %lu in use\n",
+        secs, accepted, active, ok, failed, dropped, in, out,
+        secs > 0 ? in / secs / 1e6 : 0,
+        percentile(hist, 0.50), percentile(hist, 0.99),
+        allocated, in_use);
+    put_length(c->out, n);
+    c->olen = 4 + n;
+    finish(c, "ok\n");
+}
+
+/* Take the request line out of the input buffer, leaving the rest of
+ * the input in place. Returns zero until the line is complete.
+ */
+static int
+header(struct conn *c)
+{
+    char *s = c->fr.generic.buf;
+    size_t len = c->fr.generic.len;
+    char *nl = memchr(s, 0x0a, len);
+    size_t n = nl ? (size_t)(nl - s) : len;
+
+    c->fr.generic.len = 0;
+    if (c->hlen + n >= HDRLEN) {
+        finish(c, "error: request line too long\n");
+        return 0;
+    }
+    memcpy(c->header + c->hlen, s, n);
+    c->hlen += n;
+    if (!nl)
+        return 0;
+
+    c->header[c->hlen] = 0;
+    if (c->hlen && c->header[c->hlen - 1] == 0x0d)
+        c->header[c->hlen - 1] = 0;
+    if (!strcmp(c->header, "stats")) {
+        report(c);
+        return 0;
+    }
+    if (!request(c, c->header)) {
+        finish(c, "error: bad request line\n");
+        return 0;
+    }
+    /* request() reset the codecs, so point them at the rest anew */
+    c->fr.generic.buf = nl + 1;
+    c->fr.generic.len = len - n - 1;
+    c->state = C_STREAM;
+    return 1;
+}
+
+static unsigned long
+count_lines(const char *s, size_t len)
+{
+    unsigned long n = 0;
+    const char *end = s + len;
+    while ((s = memchr(s, 0x0a, end - s))) {
+        n++;
+        s++;
+    }
+    return n;
+}
+
+/* Frame the output converted so far, ahead of any end frame. */
+static void
+frame(struct conn *c)
+{
+    size_t n = c->to.generic.buf - (c->out + 4);
+    if (!c->olen && n) {
+        put_length(c->out, n);
+        c->olen = 4 + n;
+    }
+}
+
+/* Convert as much input as fits into one output frame. */
+static void
+convert(struct conn *c)
+{
+    union polyctx *fr = &c->fr;
+    union polyctx *to = &c->to;
+    size_t n;
+
+    to->generic.buf = c->out + 4;
+    to->generic.len = BUFLEN - 4 - TRAILER;
+
+    for (;;) {
+        long ch;
+
+        if (c->has_pending) {
+            if (c->encode(to, c->pending) == CTX_FULL)
+                break;
+            c->has_pending = 0;
+            if (c->pending == CTX_FLUSH) {
+                frame(c);
+                finish(c, "ok\n");
+                break;
+            }
+        }
+
+        /* copy what both codecs would leave unchanged */
+        n = c->decode_span(fr, fr->generic.buf, fr->generic.len);
+        n = c->encode_span(to, fr->generic.buf, n);
+        if (n > to->generic.len)
+            n = to->generic.len;
+        memcpy(to->generic.buf, fr->generic.buf, n);
+        c->lineno += count_lines(fr->generic.buf, n);
+        to->generic.buf += n;
+        to->generic.len -= n;
+        fr->generic.buf += n;
+        fr->generic.len -= n;
+        if (c->replacement && c->decode == wrap_utf7_decode)
+            c->lenient.offset += n;
+
+        ch = c->decode(fr);
+        if (ch >= 0) {
+            if (ch > c->max && !c->replacement) {
+                frame(c);
+                finish(c, "error: line %lu: U+%04lX not representable\n",
+                       c->lineno, ch);
+                break;
+            }
+            c->lineno += ch == 0x0a;
+            c->pending = ch > c->max ? c->replacement : ch;
+            c->has_pending = 1;
+            continue;
+        }
+
+        if (ch == CTX_INVALID) {
+            frame(c);
+            finish(c, "error: line %lu: invalid input\n", c->lineno);
+            break;
+        }
+        if (c->state != C_EOF)
+            break;  /* wait for more input */
+        if (ch == CTX_INCOMPLETE) {
+            if (!c->replacement) {
+                frame(c);
+                finish(c, "error: line %lu: truncated input\n", c->lineno);
+                break;
+            }
+            /* decoding again finds it truncated again, so retry is safe */
+            if (c->encode(to, c->replacement) == CTX_FULL)
+                break;
+        }
+        c->pending = CTX_FLUSH;
+        c->has_pending = 1;
+    }
+    frame(c);
+}
+
+/* Advance a connection as far as it can go without blocking, then
+ * either re-arm it or close it.
+ */
+static void
+service(struct conn *c)
+{
+    for (;;) {
+        ssize_t r;
+
+        /* flush queued output first */
+        while (c->owrite < c->olen) {
+            r = write(c->fd, c->out + c->owrite, c->olen - c->owrite);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0 && errno == EAGAIN) {
+                arm(c, EPOLLOUT);
+                return;
+            }
+            if (r < 0) {
+                conn_close(c);
+                return;
+            }
+            c->owrite += r;
+            c->bytes_out += r;
+        }
+        if (c->state == C_CLOSING) {
+            conn_close(c);
+            return;
+        }
+        c->olen = c->owrite = 0;
+
+        /* convert what's left of the last read, or read more */
+        if (!c->has_pending && !c->fr.generic.len && c->state != C_EOF) {
+            if (!c->in)
+                c->in = pool_get();
+            r = read(c->fd, c->in, BUFLEN);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0 && errno == EAGAIN) {
+                /* idle: hand the buffers back while waiting */
+                pool_put(c->in);
+                pool_put(c->out);
+                c->in = c->out = 0;
+                arm(c, EPOLLIN);
+                return;
+            }
+            if (r < 0) {
+                conn_close(c);
+                return;
+            }
+            if (!c->out)
+                c->out = pool_get();
+            if (!r) {
+                if (c->state == C_HEADER) {
+                    conn_close(c);
+                    return;
+                }
+                c->state = C_EOF;
+            }
+            c->fr.generic.buf = c->in;
+            c->fr.generic.len = r;
+            c->bytes_in += r;
+            if (c->state == C_HEADER && !header(c))
+                continue;
+        }
+        if (!c->out)
+            c->out = pool_get();
+        convert(c);
+    }
+}
+
+static void
+accept_all(void)
+{
+    for (;;) {
+        struct epoll_event e;
+        struct conn *c;
+        int fd = accept(listenfd, 0, 0);
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                /* back off until connections close */
+                struct timespec ms = {0, 1000000};
+                nanosleep(&ms, 0);
+            } else if (errno != EAGAIN && errno != EINTR &&
+                       errno != ECONNABORTED) {
+                die("accept:");
+            }
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (!(c = calloc(1, sizeof(*c))))
+            die("out of memory");
+        c->fd = fd;
+        c->state = C_HEADER;
+        c->lineno = 1;
+        clock_gettime(CLOCK_MONOTONIC, &c->start);
+        pthread_mutex_lock(&stats.lock);
+        stats.accepted++;
+        stats.active++;
+        pthread_mutex_unlock(&stats.lock);
+
+        e.events = EPOLLIN | EPOLLONESHOT;
+        e.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e))
+            die("epoll_ctl:");
+    }
+}
+
+static void *
+worker(void *arg)
+{
+    struct epoll_event events[64];
+    (void)arg;
+    for (;;) {
+        int i, n = epoll_wait(epfd, events, 64, -1);
+        if (n < 0 && errno != EINTR)
+            die("epoll_wait:");
+        for (i = 0; i < n; i++) {
+            if (!events[i].data.ptr)
+                accept_all();
+            else
+                service(events[i].data.ptr);
+        }
+    }
+    return 0;
+}
+
+static void
+usage(FILE *f)
+{
+    fprintf(f, "usage: conv7d [-h] [-j THREADS] [-p PATH]\n");
+    fprintf(f, "  -h          print this help info\n");
+    fprintf(f, "  -j THREADS  worker threads [4]\n");
+    fprintf(f, "  -p PATH     Unix socket to listen on [conv7d.sock]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = "conv7d.sock";
+    int nthreads = 4;
+    struct sockaddr_un addr;
+    struct epoll_event e;
+    sigset_t set;
+    int i, option, sig;
+
+    while ((option = getopt(argc, argv, "hj:p:")) != -1) {
+        switch (option) {
+            case 'h':
+                usage(stdout);
+                exit(EXIT_SUCCESS);
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                if (nthreads < 1)
+                    die("invalid thread count, '%s'", optarg);
+                break;
+            case 'p':
+                path = optarg;
+                break;
+            default:
+                usage(stderr);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (strlen(path) >= sizeof(addr.sun_path))
+        die("socket path too long, '%s'", path);
+
+    /* workers inherit this mask, so only the main thread sees these */
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, 0);
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0)
+        die("socket:");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)))
+        die("%s:", path);
+    if (listen(listenfd, SOMAXCONN))
+        die("listen:");
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    epfd = epoll_create(1);
+    if (epfd < 0)
+        die("epoll_create:");
+    e.events = EPOLLIN;
+    e.data.ptr = 0;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &e))
+        die("epoll_ctl:");
+
+    pthread_mutex_init(&stats.lock, 0);
+    pthread_mutex_init(&pool.lock, 0);
+    clock_gettime(CLOCK_MONOTONIC, &stats.start);
+    for (i = 0; i < nthreads; i++) {
+        pthread_t t;
+        if (pthread_create(&t, 0, worker, 0))
+            die("pthread_create failed");
+    }
+
+    sigwait(&set, &sig);
+    unlink(path);
+    pthread_mutex_lock(&stats.lock);
+    fprintf(stderr, "conv7d: %lu conversions, %lu failed, %lu dropped\n",
+            stats.ok, stats.failed, stats.dropped);
+    fprintf(stderr, "conv7d: latency p50 %lu us, p99 %lu us\n",
+            percentile(stats.latency, 0.50),
+            percentile(stats.latency, 0.99));
+    return 0;
+}
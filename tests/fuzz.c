@@ -0,0 +1,1052 @@
+/* Differential fuzz testing of the fast paths against the scalar codecs
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Each input is run through the reference codec, one call per code
+ * point over a single buffer, and through every fast path using random
+ * buffer split points. Decoded code points, return codes, and the final
+ * buffer offsets must all agree. Any mismatch aborts.
+ *
+ * Input is interpreted twice: as UTF-7 and UTF-8 bytes to decode, and
+ * as a packed list of code points to encode. The split points are
+ * derived from the input itself so that every run is reproducible.
+ *
+ * Without arguments, a built-in randomized driver runs. Given file
+ * arguments, each file is run once, which suits AFL (tests/fuzz @@).
+ * Define FUZZ_NO_MAIN to link against libFuzzer instead:
+ *
+ *   clang -fsanitize=fuzzer -DFUZZ_NO_MAIN tests/fuzz.c tests/utf8.c utf7.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf8.h"
+#include "../utf7.h"
+
+#define MAXIN  4096
+#define MAXOUT (MAXIN * 8 + 16)
+
+struct result {
+    long cp[MAXIN];
+    size_t n;
+    long status;
+    size_t offset;
+    size_t errors;
+};
+
+struct rng {
+    unsigned long s;
+};
+
+static unsigned long
+rng_next(struct rng *r)
+{
+    r->s = (r->s * 1103515245UL + 12345UL) & 0xffffffffUL;
+    return r->s >> 16;
+}
+
+/* Choose the size of the next buffer: mostly tiny, sometimes large. */
+static size_t
+rng_chunk(struct rng *r)
+{
+    switch (rng_next(r) % 4) {
+        case 0:
+            return 1;
+        case 1:
+        case 2:
+            return 1 + rng_next(r) % 8;
+        default:
+            return 1 + rng_next(r) % 512;
+    }
+}
+
+static unsigned long
+seed(const unsigned char *data, size_t len)
+{
+    unsigned long h = 0x811c9dc5UL;
+    size_t i;
+    for (i = 0; i < len; i++)
+        h = ((h ^ data[i]) * 0x01000193UL) & 0xffffffffUL;
+    return h;
+}
+
+static void
+fail(const char *what, const unsigned char *data, size_t len)
+{
+    size_t i;
+    fprintf(stderr, "fuzz: mismatch in %s on input:\n", what);
+    for (i = 0; i < len; i++)
+        fprintf(stderr, "%02x%s", data[i], i % 32 == 31 ? "\n" : "");
+    fputc('\n', stderr);
+    abort();
+}
+
+static void
+compare(const char *what, const struct result *a, const struct result *b,
+        int offsets, const unsigned char *data, size_t len)
+{
+    if (a->n != b->n || memcmp(a->cp, b->cp, a->n * sizeof(*a->cp)))
+        fail(what, data, len);
+    if (a->status != b->status)
+        fail(what, data, len);
+    if (offsets && a->offset != b->offset)
+        fail(what, data, len);
+}
+
+/* Unpack code points: ASCII bytes stand for themselves, and the rest
+ * introduce a two- or three-byte code point. Surrogates are excluded.
+ */
+static size_t
+unpack(long *cp, const unsigned char *s, size_t len)
+{
+    size_t n = 0, i = 0;
+    while (i < len) {
+        long c = s[i++];
+        if (c >= 0xc0 && len - i >= 2) {
+            c = ((c & 0x3fL) << 16 | (long)s[i] << 8 | s[i + 1]) % 0x110000L;
+            i += 2;
+        } else if (c >= 0x80 && len - i >= 1) {
+            c = (c & 0x3fL) << 8 | s[i++];
+        }
+        if (c >= 0xd800L && c <= 0xdfffL)
+            c = 0xfffdL;
+        cp[n++] = c;
+    }
+    return n;
+}
+
+/* Move a context's state out to a compact state or a saved blob,
+ * scribble over it, and load it back, as a proxy would between buffers.
+ */
+static void
+reload(struct utf7 *ctx, const char *indirect, struct rng *rng)
+{
+    struct utf7_set set;
+    struct utf7_state state;
+    unsigned char blob[UTF7_STATE_SIZE];
+    int saved = rng_next(rng) % 2;
+    utf7_set_init(&set, indirect);
+    utf7_store(ctx, &state);
+    if (saved)
+        utf7_save_state(ctx, blob);
+    ctx->accum = rng_next(rng);
+    ctx->bits = 99;
+    ctx->flags = ~0U;
+    ctx->high = 0xffff;
+    memset(ctx->direct, 0, sizeof(ctx->direct));
+    utf7_load(ctx, &set, &state);
+    if (saved && utf7_load_state(ctx, blob) != UTF7_OK)
+        abort();
+}
+
+/* Save a UTF-8 context's state, scribble over it, and load it back. */
+static void
+reload8(struct utf8 *ctx)
+{
+    unsigned char blob[UTF8_STATE_SIZE];
+    utf8_save_state(ctx, blob);
+    memset(ctx->hold, 0xff, sizeof(ctx->hold));
+    ctx->n = 99;
+    if (utf8_load_state(ctx, blob) != UTF8_OK)
+        abort();
+}
+
+/* Reference UTF-7 decoder: the whole input in a single buffer. */
+static void
+decode7_ref(struct result *r, const unsigned char *data, size_t len,
+            int lenient)
+{
+    struct utf7 ctx;
+    struct utf7_lenient l;
+    utf7_init(&ctx, 0);
+    if (lenient)
+        utf7_lenient(&ctx, &l, 0xfffd, 0, 0);
+    ctx.buf = (char *)data;
+    ctx.len = len;
+    r->n = 0;
+    while ((r->status = utf7_decode(&ctx)) >= 0)
+        r->cp[r->n++] = r->status;
+    r->offset = ctx.buf - (char *)data;
+    r->errors = lenient ? l.count : 0;
+}
+
+/* UTF-7 decoder over random splits, optionally copying direct spans. */
+static void
+decode7_split(struct result *r, const unsigned char *data, size_t len,
+              struct rng *rng, int spans, int lenient)
+{
+    size_t off = 0;
+    struct utf7 ctx;
+    struct utf7_lenient l;
+    utf7_init(&ctx, 0);
+    if (lenient)
+        utf7_lenient(&ctx, &l, 0xfffd, 0, 0);
+    ctx.buf = (char *)data;
+    ctx.len = 0;
+    r->n = 0;
+    for (;;) {
+        long c;
+        if (spans) {
+            size_t i, k = utf7_decode_span(&ctx, ctx.buf, ctx.len);
+            for (i = 0; i < k; i++)
+                r->cp[r->n++] = (unsigned char)ctx.buf[i];
+            ctx.buf += k;
+            ctx.len -= k;
+            if (lenient)
+                l.offset += k;
+        }
+        c = utf7_decode(&ctx);
+        if (c >= 0) {
+            r->cp[r->n++] = c;
+        } else if (c == UTF7_INVALID || off == len) {
+            r->status = c;
+            break;
+        } else {
+            size_t z = rng_chunk(rng);
+            reload(&ctx, 0, rng);
+            ctx.len = z < len - off ? z : len - off;
+            off += ctx.len;
+        }
+    }
+    r->offset = ctx.buf - (char *)data;
+    r->errors = lenient ? l.count : 0;
+    if (lenient && l.offset != r->offset)
+        r->errors = (size_t)-1;
+}
+
+/* Callback state for the writer and reader: a memory buffer read or
+ * written in random chunks.
+ */
+struct memio {
+    char *p;
+    size_t len;
+    struct rng *rng;
+};
+
+static int
+mem_sink(void *user, const char *buf, size_t len)
+{
+    struct memio *m = user;
+    memcpy(m->p, buf, len);
+    m->p += len;
+    return 0;
+}
+
+static long
+mem_source(void *user, char *buf, size_t len)
+{
+    struct memio *m = user;
+    size_t z = rng_chunk(m->rng);
+    z = z < len ? z : len;
+    z = z < m->len ? z : m->len;
+    memcpy(buf, m->p, z);
+    m->p += z;
+    m->len -= z;
+    return (long)z;
+}
+
+/* UTF-7 decoder pulling random chunks through a reader. */
+static void
+decode7_reader(struct result *r, const unsigned char *data, size_t len,
+               struct rng *rng)
+{
+    char stage[512];
+    struct memio m;
+    struct utf7_reader rd;
+    m.p = (char *)data;
+    m.len = len;
+    m.rng = rng;
+    utf7_reader_init(&rd, stage, 1 + rng_next(rng) % sizeof(stage),
+                     mem_source, &m);
+    r->n = 0;
+    while ((r->status = utf7_read(&rd)) >= 0)
+        r->cp[r->n++] = r->status;
+    r->offset = 0;
+    r->errors = 0;
+}
+
+/* Index the input in random chunks, round trip the index through its
+ * serialized form, then seek to random code points and check them
+ * against the reference decoder.
+ */
+static void
+index7(const struct result *ref, const unsigned char *data, size_t len,
+       struct rng *rng)
+{
+    static unsigned char saved[56 + 24 * 16];
+    struct utf7_checkpoint points[16], loaded[16];
+    struct utf7_index idx;
+    size_t off = 0, cap = 1 + rng_next(rng) % 16;
+    int i;
+    long c;
+
+    utf7_index_init(&idx, points, cap, 1 + rng_next(rng) % 64);
+    do {
+        size_t z = rng_chunk(rng);
+        z = z < len - off ? z : len - off;
+        c = utf7_index_feed(&idx, (char *)data + off, z);
+        off += z;
+        /* sometimes save and reload before feeding the rest */
+        if (!(rng_next(rng) % 4)) {
+            size_t z = utf7_index_save(&idx, saved, sizeof(saved));
+            if (z > sizeof(saved) ||
+                utf7_index_load(&idx, points, cap, saved, z) != UTF7_OK)
+                fail("utf7_index_load", data, len);
+        }
+    } while (c != UTF7_INVALID && off < len);
+    if (c != ref->status || idx.byte != ref->offset || idx.codepoint != ref->n)
+        fail("utf7_index_feed", data, len);
+
+    if (utf7_index_save(&idx, saved, sizeof(saved)) > sizeof(saved) ||
+        utf7_index_load(&idx, loaded, cap, saved, sizeof(saved)) != UTF7_OK ||
+        idx.byte != ref->offset || idx.codepoint != ref->n)
+        fail("utf7_index_load", data, len);
+
+    for (i = 0; ref->n && i < 8; i++) {
+        unsigned long t = rng_next(rng) % ref->n;
+        const struct utf7_checkpoint *p = utf7_index_find(&idx, t);
+        struct utf7 ctx;
+        unsigned long k;
+        utf7_init(&ctx, 0);
+        if (!p || utf7_index_seek(&ctx, p) != UTF7_OK || p->codepoint > t)
+            fail("utf7_index_find", data, len);
+        ctx.buf = (char *)data + p->byte;
+        ctx.len = len - p->byte;
+        for (k = p->codepoint; k < t; k++)
+            utf7_decode(&ctx);
+        if (utf7_decode(&ctx) != ref->cp[t])
+            fail("utf7_index_seek", data, len);
+    }
+}
+
+/* Search for a random pattern, usually taken from the decoded input,
+ * and check against a naive search over the reference decoding.
+ */
+static void
+search7(const struct result *ref, const unsigned char *data, size_t len,
+        struct rng *rng)
+{
+    long pattern[8];
+    size_t table[16];
+    size_t i, j, plen = 1 + rng_next(rng) % 8;
+    unsigned long from = rng_next(rng) % 4 ? 0 : rng_next(rng) % 64;
+    struct utf7_search s;
+    struct utf7_match m;
+    int r, expect = ref->status == UTF7_OK ? 0 : (int)ref->status;
+    size_t at = ref->n;
+
+    if (ref->n && rng_next(rng) % 4) {
+        size_t start = rng_next(rng) % ref->n;
+        for (i = 0; i < plen; i++)
+            pattern[i] = ref->cp[(start + i) % ref->n];
+    } else {
+        for (i = 0; i < plen; i++)
+            pattern[i] = 0x41 + rng_next(rng) % 3;
+    }
+
+    for (i = from; plen <= ref->n && i <= ref->n - plen; i++) {
+        for (j = 0; j < plen && ref->cp[i + j] == pattern[j]; j++);
+        if (j == plen) {
+            at = i;
+            expect = 1;
+            break;
+        }
+    }
+
+    utf7_search_init(&s, pattern, plen, table);
+    r = utf7_search(&s, (char *)data, len, from, &m);
+    if (r != expect || m.codepoint != at || m.byte > len)
+        fail("utf7_search", data, len);
+}
+
+/* Compare the input against a valid encoding b, and check the result
+ * against the reference decodings of both.
+ */
+static void
+compare7(const struct result *ra, const unsigned char *data, size_t len,
+         const char *b, size_t blen)
+{
+    static struct result rb;
+    int order = 2, expect = 2;
+    long status = UTF7_OK;
+    size_t i, n;
+
+    decode7_ref(&rb, (const unsigned char *)b, blen, 0);
+    n = ra->n < rb.n ? ra->n : rb.n;
+    for (i = 0; i < n && ra->cp[i] == rb.cp[i]; i++);
+    if (i < n)
+        expect = ra->cp[i] < rb.cp[i] ? -1 : 1;
+    else if (ra->n > rb.n)
+        expect = 1;
+    else if (ra->status != UTF7_OK)
+        status = ra->status;
+    else
+        expect = ra->n < rb.n ? -1 : 0;
+
+    if (utf7_compare((char *)data, len, b, blen, &order) != status ||
+        (status == UTF7_OK && order != expect))
+        fail("utf7_compare", data, len);
+    if (utf7_compare(b, blen, (char *)data, len, &order) != status ||
+        (status == UTF7_OK && order != -expect))
+        fail("utf7_compare", data, len);
+}
+
+/* Reference UTF-7 encoder: one big output buffer. */
+static size_t
+encode7_ref(char *out, const long *cp, size_t n, const char *indirect)
+{
+    size_t i;
+    struct utf7 ctx;
+    utf7_init(&ctx, indirect);
+    ctx.buf = out;
+    ctx.len = MAXOUT;
+    for (i = 0; i < n; i++)
+        utf7_encode(&ctx, cp[i]);
+    utf7_encode(&ctx, UTF7_FLUSH);
+    return ctx.buf - out;
+}
+
+/* UTF-7 encoder pushing through a writer with a random stage size. */
+static size_t
+encode7_writer(char *out, const long *cp, size_t n, const char *indirect,
+               struct rng *rng)
+{
+    char stage[UTF7_MAX_ENCODE + 64];
+    size_t i;
+    struct memio m;
+    struct utf7_writer w;
+    m.p = out;
+    m.len = MAXOUT;
+    m.rng = rng;
+    utf7_writer_init(&w, indirect, stage,
+                     1 + rng_next(rng) % sizeof(stage), mem_sink, &m);
+    for (i = 0; i < n; i++)
+        utf7_write(&w, cp[i]);
+    utf7_write(&w, UTF7_FLUSH);
+    return m.p - out;
+}
+
+/* Batch encode random slices, then check each slice against the
+ * reference encoder and batch decode them back.
+ */
+static void
+batch7(const long *cp, size_t n, const char *indirect, struct rng *rng,
+       const unsigned char *data, size_t len)
+{
+    static char out[MAXOUT], one[MAXOUT];
+    static long back[MAXIN];
+    size_t in_off[9], out_off[9], back_off[9];
+    size_t i, count = 1 + rng_next(rng) % 8, done;
+    struct utf7 proto;
+
+    in_off[0] = 0;
+    for (i = 1; i < count; i++)
+        in_off[i] = in_off[i - 1] + rng_next(rng) % (n - in_off[i - 1] + 1);
+    in_off[count] = n;
+
+    utf7_init(&proto, indirect);
+    if (utf7_encode_batch(&proto, cp, in_off, count, out, sizeof(out),
+                          out_off, &done) != UTF7_OK || done != count)
+        fail("utf7_encode_batch", data, len);
+    for (i = 0; i < count; i++) {
+        size_t z = encode7_ref(one, cp + in_off[i], in_off[i + 1] - in_off[i],
+                               indirect);
+        if (z != out_off[i + 1] - out_off[i] ||
+            memcmp(one, out + out_off[i], z))
+            fail("utf7_encode_batch", data, len);
+    }
+    if (utf7_decode_batch(out, out_off, count, back, MAXIN,
+                          back_off, &done) != UTF7_OK || done != count ||
+        memcmp(back_off, in_off, (count + 1) * sizeof(*in_off)) ||
+        memcmp(back, cp, n * sizeof(*cp)))
+        fail("utf7_decode_batch", data, len);
+}
+
+/* Encode random slices as separate fragments, then join them and check
+ * the result against the single pass encoding.
+ */
+static void
+join7(const long *cp, size_t n, const char *indirect, struct rng *rng,
+      const char *want, size_t wlen, const unsigned char *data, size_t len)
+{
+    static char out[MAXOUT], frag[MAXOUT];
+    size_t i = 0;
+    struct utf7 ctx, enc;
+    struct utf7_seam seam, fseam;
+
+    utf7_init(&ctx, indirect);
+    ctx.buf = out;
+    ctx.len = MAXOUT;
+    utf7_seam_init(&seam);
+    do {
+        size_t end = i + rng_next(rng) % (n - i + 1);
+        utf7_init(&enc, indirect);
+        enc.buf = frag;
+        enc.len = MAXOUT;
+        for (; i < end; i++)
+            utf7_encode(&enc, cp[i]);
+        if (utf7_finish(&enc, &fseam) != UTF7_OK ||
+            utf7_append(&ctx, &seam, frag, enc.buf - frag, &fseam) != UTF7_OK)
+            fail("utf7_append", data, len);
+    } while (i < n);
+    if ((size_t)(ctx.buf - out) != wlen || memcmp(out, want, wlen))
+        fail("utf7_append", data, len);
+}
+
+/* Replace a random range of code points with another slice of them,
+ * through utf7_edit() over a random index. A canonical document must
+ * come out the same as encoding the edited code points from scratch,
+ * and any other must decode to them. Then check the adjusted index.
+ */
+static void
+edit7(const long *cp, size_t n, const char *indirect, struct rng *rng,
+      const char *doc, size_t dlen, int canonical,
+      const unsigned char *data, size_t len)
+{
+    static struct result got;
+    static long edited[MAXIN * 2];
+    static char want[MAXOUT * 2], out[MAXOUT * 2];
+    struct utf7_checkpoint points[16];
+    struct utf7_index idx;
+    struct utf7_splice sp;
+    struct utf7 ctx;
+    size_t i, m, nw, from, to, at, k;
+    int indexed = rng_next(rng) % 4 != 0;
+    int r;
+
+    from = rng_next(rng) % (n + 2);
+    to = from + rng_next(rng) % 8;
+    at = rng_next(rng) % (n + 1);
+    k = rng_next(rng) % 8;
+    k = k < n - at ? k : n - at;
+
+    for (m = 0; m < from && m < n; m++)
+        edited[m] = cp[m];
+    for (i = 0; i < k; i++)
+        edited[m++] = cp[at + i];
+    for (i = to; i < n; i++)
+        edited[m++] = cp[i];
+    nw = encode7_ref(want, edited, m, indirect);
+
+    utf7_index_init(&idx, points, 1 + rng_next(rng) % 16,
+                    1 + rng_next(rng) % 64);
+    if (indexed)
+        utf7_index_feed(&idx, doc, dlen);
+    utf7_init(&ctx, indirect);
+    ctx.buf = out;
+    ctx.len = rng_next(rng) % 2 ? MAXOUT : rng_chunk(rng);
+    r = utf7_edit(&ctx, doc, dlen, indexed ? &idx : 0, from, to,
+                  cp + at, k, &sp);
+    if (r == UTF7_FULL) {
+        ctx.len = MAXOUT;
+        if (ctx.buf != out)
+            fail("utf7_edit full", data, len);
+        r = utf7_edit(&ctx, doc, dlen, indexed ? &idx : 0, from, to,
+                      cp + at, k, &sp);
+    }
+    if (r != UTF7_OK || sp.head > sp.tail || sp.tail > dlen ||
+        (size_t)(ctx.buf - out) != sp.length)
+        fail("utf7_edit", data, len);
+
+    /* splice it together in place */
+    memmove(out + sp.head, out, sp.length);
+    memcpy(out, doc, sp.head);
+    memcpy(out + sp.head + sp.length, doc + sp.tail, dlen - sp.tail);
+    if (sp.added + n != sp.removed + m)
+        fail("utf7_edit count", data, len);
+    if (canonical) {
+        if (sp.head + sp.length + dlen - sp.tail != nw ||
+            memcmp(out, want, nw))
+            fail("utf7_edit", data, len);
+    } else {
+        nw = sp.head + sp.length + dlen - sp.tail;
+        memcpy(want, out, nw);
+        decode7_ref(&got, (unsigned char *)want, nw, 0);
+        if (got.status != UTF7_OK || got.n != m ||
+            memcmp(got.cp, edited, m * sizeof(*edited)))
+            fail("utf7_edit", data, len);
+    }
+
+    if (!indexed)
+        return;
+    utf7_index_splice(&idx, &sp);
+    if (idx.byte != nw || idx.codepoint != m)
+        fail("utf7_index_splice", data, len);
+    for (i = 0; i < idx.count; i++) {
+        const struct utf7_checkpoint *p = idx.points + i;
+        utf7_init(&ctx, 0);
+        utf7_index_seek(&ctx, p);
+        ctx.buf = want + p->byte;
+        ctx.len = nw - p->byte;
+        if (p->codepoint < m && utf7_decode(&ctx) != edited[p->codepoint])
+            fail("utf7_index_splice", data, len);
+    }
+}
+
+/* Canonicalize over random input splits and output sizes, returning
+ * the final status and, when it's UTF7_OK, the flushed output length.
+ */
+static long
+canon7(char *out, size_t *outlen, const unsigned char *data, size_t len,
+       const char *indirect, struct rng *rng, int lenient)
+{
+    size_t off = 0;
+    long r;
+    struct utf7 enc, dec;
+    struct utf7_lenient l;
+
+    utf7_init(&enc, indirect);
+    utf7_init(&dec, 0);
+    if (lenient)
+        utf7_lenient(&dec, &l, 0xfffd, 0, 0);
+    enc.buf = out;
+    enc.len = 0;
+    dec.buf = (char *)data;
+    dec.len = 0;
+    for (;;) {
+        r = utf7_canonicalize(&enc, &dec);
+        if (r == UTF7_FULL) {
+            enc.len = 1 + rng_next(rng) % 16;
+        } else if (r == UTF7_INVALID || off == len) {
+            break;
+        } else {
+            size_t z = rng_chunk(rng);
+            dec.len = z < len - off ? z : len - off;
+            off += dec.len;
+        }
+    }
+    if (lenient && l.offset != len)
+        fail("utf7_canonicalize lenient", data, len);
+    if (r == UTF7_OK) {
+        enc.len = UTF7_MAX_ENCODE;
+        utf7_encode(&enc, UTF7_FLUSH);
+    }
+    *outlen = enc.buf - out;
+    return r;
+}
+
+/* Latin-1 through the byte-oriented entry points, over random splits
+ * of both input and output, against the code point codecs.
+ */
+static void
+latin1_7(const unsigned char *data, size_t len, const char *indirect,
+         struct rng *rng)
+{
+    static long cp[MAXIN];
+    static char a[MAXOUT], b[MAXOUT];
+    static struct result ref, alt;
+    size_t i, na, off = 0, end = 0;
+    struct utf7 ctx;
+    long r;
+
+    for (i = 0; i < len; i++)
+        cp[i] = data[i];
+    na = encode7_ref(a, cp, len, indirect);
+    utf7_init(&ctx, indirect);
+    ctx.buf = b;
+    ctx.len = rng_chunk(rng);
+    while (off < len) {
+        size_t z = rng_chunk(rng);
+        end = z < len - off ? off + z : len;
+        off += utf7_encode_latin1(&ctx, (char *)data + off, end - off);
+        if (off < end && ctx.len)
+            fail("utf7_encode_latin1", data, len);
+        if (!ctx.len) {
+            reload(&ctx, indirect, rng);
+            ctx.len = rng_chunk(rng);
+        }
+    }
+    ctx.len = UTF7_MAX_ENCODE;
+    utf7_encode(&ctx, UTF7_FLUSH);
+    if ((size_t)(ctx.buf - b) != na || memcmp(a, b, na))
+        fail("utf7_encode_latin1", data, len);
+
+    decode7_ref(&ref, data, len, 0);
+    utf7_init(&ctx, 0);
+    ctx.buf = (char *)data;
+    ctx.len = 0;
+    off = 0;
+    alt.n = 0;
+    for (;;) {
+        size_t n = rng_chunk(rng) % 8;
+        r = utf7_decode_latin1(&ctx, a, &n);
+        for (i = 0; i < n; i++)
+            alt.cp[alt.n++] = (unsigned char)a[i];
+        if (r >= 0) {
+            alt.cp[alt.n++] = r;
+        } else if (r == UTF7_INVALID || (r != UTF7_FULL && off == len)) {
+            break;
+        } else if (r != UTF7_FULL) {
+            size_t z = rng_chunk(rng);
+            ctx.len = z < len - off ? z : len - off;
+            off += ctx.len;
+        }
+    }
+    alt.status = r;
+    alt.offset = ctx.buf - (char *)data;
+    compare("utf7_decode_latin1", &ref, &alt, 1, data, len);
+}
+
+/* An arena that runs out after a random number of allocations. */
+struct fuzz_arena {
+    struct utf7_arena arena;
+    int left;
+};
+
+static void *
+fuzz_alloc(void *user, size_t size)
+{
+    struct fuzz_arena *a = user;
+    return a->left-- ? utf7_arena_alloc(&a->arena, size) : 0;
+}
+
+/* The _alloc functions, chained or gathered, against the plain codecs. */
+static void
+alloc7(const long *cp, size_t n, const char *indirect, struct rng *rng,
+       const char *a, size_t na, const unsigned char *data, size_t len)
+{
+    static long mem[1L << 16];
+    static char out[MAXOUT * sizeof(long)];
+    static struct result ref;
+    struct fuzz_arena fa;
+    struct utf7_output o;
+    struct utf7_lenient l;
+    struct utf7 ctx;
+    int r, lenient = rng_next(rng) % 2;
+    size_t i, k = 0;
+
+    fa.arena.beg = (char *)mem;
+    fa.arena.end = (char *)(mem + sizeof(mem) / sizeof(*mem));
+    fa.left = rng_next(rng) % 4 ? -1 : (int)(rng_next(rng) % 4);
+    utf7_init(&ctx, indirect);
+    r = utf7_encode_alloc(&ctx, cp, n, rng_next(rng) % 2 ? UTF7_GATHER : 0,
+                          fuzz_alloc, &fa, &o);
+    for (i = 0; i < o.count; i++) {
+        memcpy(out + k, o.iov[i].base, o.iov[i].len);
+        k += o.iov[i].len;
+    }
+    /* the allocator failed if and only if left is now exactly -1 */
+    if (r == UTF7_ABORT ? fa.left != -1 || o.count :
+        fa.left == -1 || k != na || o.total != na || memcmp(out, a, na))
+        fail("utf7_encode_alloc", data, len);
+
+    fa.arena.beg = (char *)mem;
+    fa.left = rng_next(rng) % 4 ? -1 : (int)(rng_next(rng) % 4);
+    decode7_ref(&ref, data, len, lenient);
+    utf7_init(&ctx, 0);
+    if (lenient)
+        utf7_lenient(&ctx, &l, 0xfffd, 0, 0);
+    ctx.buf = (char *)data;
+    ctx.len = len;
+    r = utf7_decode_alloc(&ctx, rng_next(rng) % 2 ? UTF7_GATHER : 0,
+                          fuzz_alloc, &fa, &o);
+    for (i = k = 0; i < o.count; i++) {
+        memcpy(out + k, o.iov[i].base, o.iov[i].len);
+        k += o.iov[i].len;
+    }
+    if (r == UTF7_ABORT ? fa.left != -1 || o.count :
+        fa.left == -1 || r != ref.status || o.total != k ||
+        k != ref.n * sizeof(long) || memcmp(out, ref.cp, k))
+        fail("utf7_decode_alloc", data, len);
+}
+
+/* UTF-7 encoder over random splits, optionally copying direct spans. */
+static size_t
+encode7_split(char *out, const long *cp, size_t n, const char *indirect,
+              struct rng *rng, int spans)
+{
+    size_t i = 0;
+    struct utf7 ctx;
+    utf7_init(&ctx, indirect);
+    ctx.buf = out;
+    ctx.len = rng_chunk(rng);
+    while (i <= n) {
+        if (spans && i < n) {
+            char tmp[64];
+            size_t m, k;
+            for (m = 0; m < sizeof(tmp) && i + m < n && cp[i + m] < 0x80; m++)
+                tmp[m] = (char)cp[i + m];
+            k = utf7_encode_span(&ctx, tmp, m);
+            k = k < ctx.len ? k : ctx.len;
+            memcpy(ctx.buf, tmp, k);
+            ctx.buf += k;
+            ctx.len -= k;
+            i += k;
+        }
+        if (utf7_encode(&ctx, i < n ? cp[i] : UTF7_FLUSH) == UTF7_OK) {
+            i++;
+        } else {
+            reload(&ctx, indirect, rng);
+            ctx.len = rng_chunk(rng);
+        }
+    }
+    return ctx.buf - out;
+}
+
+/* Reference UTF-8 decoder: the whole input in a single buffer. */
+static void
+decode8_ref(struct result *r, const unsigned char *data, size_t len)
+{
+    struct utf8 ctx;
+    utf8_init(&ctx);
+    ctx.buf = (char *)data;
+    ctx.len = len;
+    r->n = 0;
+    while ((r->status = utf8_decode(&ctx)) >= 0)
+        r->cp[r->n++] = r->status;
+    r->offset = ctx.buf - (char *)data;
+}
+
+/* Block UTF-8 decoder over random splits. */
+static void
+decode8_block(struct result *r, const unsigned char *data, size_t len,
+              struct rng *rng)
+{
+    size_t off = 0;
+    struct utf8 ctx;
+    utf8_init(&ctx);
+    ctx.buf = (char *)data;
+    ctx.len = 0;
+    r->n = 0;
+    for (;;) {
+        long c;
+        r->n += utf8_decode_block(&ctx, r->cp + r->n, 1 + rng_next(rng) % 64);
+        c = utf8_decode(&ctx);
+        if (c >= 0) {
+            r->cp[r->n++] = c;
+        } else if (c == UTF8_INVALID || off == len) {
+            r->status = c;
+            break;
+        } else {
+            size_t z = rng_chunk(rng);
+            reload8(&ctx);
+            ctx.len = z < len - off ? z : len - off;
+            off += ctx.len;
+        }
+    }
+    r->offset = ctx.buf - (char *)data;
+}
+
+/* Reference UTF-8 encoder: one big output buffer. */
+static size_t
+encode8_ref(char *out, const long *cp, size_t n)
+{
+    size_t i;
+    struct utf8 ctx;
+    utf8_init(&ctx);
+    ctx.buf = out;
+    ctx.len = MAXOUT;
+    for (i = 0; i < n; i++)
+        utf8_encode(&ctx, cp[i]);
+    return ctx.buf - out;
+}
+
+/* Block UTF-8 encoder over random splits. */
+static size_t
+encode8_block(char *out, const long *cp, size_t n, struct rng *rng)
+{
+    size_t i = 0;
+    struct utf8 ctx;
+    utf8_init(&ctx);
+    ctx.buf = out;
+    ctx.len = rng_chunk(rng);
+    while (i < n) {
+        size_t k = utf8_encode_block(&ctx, cp + i, n - i);
+        if (!k && utf8_encode(&ctx, cp[i]) == UTF8_OK)
+            k = 1;
+        i += k;
+        if (!ctx.len) {
+            reload8(&ctx);
+            ctx.len = rng_chunk(rng);
+        }
+    }
+    while (utf8_encode(&ctx, UTF8_FLUSH) != UTF8_OK) {
+        reload8(&ctx);
+        ctx.len = rng_chunk(rng);
+    }
+    return ctx.buf - out;
+}
+
+static int
+fuzz_one(const unsigned char *data, size_t len)
+{
+    static struct result ref, alt;
+    static long cp[MAXIN];
+    static char a[MAXOUT], b[MAXOUT], c[MAXOUT];
+    static const char *const indirects[] = {0, "=", "\t\n ~!"};
+    const char *indirect;
+    struct rng rng;
+    size_t n, na, nb, nc;
+    long r;
+
+    if (len > MAXIN)
+        len = MAXIN;
+    rng.s = seed(data, len);
+    indirect = indirects[rng_next(&rng) % 3];
+
+    /* UTF-7 decoding */
+    decode7_ref(&ref, data, len, 0);
+    decode7_split(&alt, data, len, &rng, 0, 0);
+    compare("utf7_decode split", &ref, &alt, 1, data, len);
+    decode7_split(&alt, data, len, &rng, 1, 0);
+    compare("utf7_decode_span", &ref, &alt, 1, data, len);
+    decode7_reader(&alt, data, len, &rng);
+    compare("utf7_read", &ref, &alt, 0, data, len);
+    index7(&ref, data, len, &rng);
+    search7(&ref, data, len, &rng);
+
+    /* lenient UTF-7 decoding never fails, and agrees on valid input */
+    if (ref.status != UTF7_INVALID) {
+        decode7_ref(&alt, data, len, 1);
+        compare("utf7_decode lenient", &ref, &alt, 1, data, len);
+    }
+    decode7_ref(&ref, data, len, 1);
+    if (ref.status == UTF7_INVALID || ref.offset != len)
+        fail("utf7_decode lenient", data, len);
+    decode7_split(&alt, data, len, &rng, 1, 1);
+    compare("utf7_decode lenient split", &ref, &alt, 1, data, len);
+    if (ref.errors != alt.errors)
+        fail("utf7_decode lenient split", data, len);
+
+    /* UTF-7 encoding and round trip */
+    n = unpack(cp, data, len);
+    na = encode7_ref(a, cp, n, indirect);
+    nb = encode7_split(b, cp, n, indirect, &rng, 0);
+    if (na != nb || memcmp(a, b, na))
+        fail("utf7_encode split", data, len);
+    nb = encode7_split(b, cp, n, indirect, &rng, 1);
+    if (na != nb || memcmp(a, b, na))
+        fail("utf7_encode_span", data, len);
+    nb = encode7_writer(b, cp, n, indirect, &rng);
+    if (na != nb || memcmp(a, b, na))
+        fail("utf7_write", data, len);
+    decode7_ref(&ref, (unsigned char *)a, na, 0);
+    if (ref.status != UTF7_OK || ref.n != n ||
+        memcmp(ref.cp, cp, n * sizeof(*cp)))
+        fail("utf7 round trip", data, len);
+    batch7(cp, n, indirect, &rng, data, len);
+    join7(cp, n, indirect, &rng, a, na, data, len);
+    latin1_7(data, len, indirect, &rng);
+    alloc7(cp, n, indirect, &rng, a, na, data, len);
+    edit7(cp, n, indirect, &rng, a, na, 1, data, len);
+
+    /* comparison against another spelling, and against the input */
+    nb = encode7_ref(b, cp, n, indirects[rng_next(&rng) % 3]);
+    if (!utf7_equal(a, na, b, nb))
+        fail("utf7_equal", data, len);
+    decode7_ref(&ref, data, len, 0);
+    compare7(&ref, data, len, a, na);
+    if (ref.status == UTF7_OK)
+        edit7(ref.cp, ref.n, indirect, &rng, (char *)data, len, 0, data, len);
+
+    /* canonicalizing other spellings, arbitrary input, and itself */
+    if (canon7(c, &nc, (unsigned char *)b, nb, indirect, &rng, 0) != UTF7_OK ||
+        nc != na || memcmp(a, c, na))
+        fail("utf7_canonicalize", data, len);
+    if (canon7(c, &nc, (unsigned char *)a, na, indirect, &rng, 0) != UTF7_OK ||
+        nc != na || memcmp(a, c, na))
+        fail("utf7_canonicalize", data, len);
+    r = canon7(c, &nc, data, len, indirect, &rng, 0);
+    if (r != ref.status)
+        fail("utf7_canonicalize", data, len);
+    if (r == UTF7_OK) {
+        na = encode7_ref(a, ref.cp, ref.n, indirect);
+        if (nc != na || memcmp(a, c, na))
+            fail("utf7_canonicalize", data, len);
+    }
+    decode7_ref(&ref, data, len, 1);
+    r = canon7(c, &nc, data, len, indirect, &rng, 1);
+    na = encode7_ref(a, ref.cp, ref.n, indirect);
+    if (r != ref.status || (r == UTF7_OK && (nc != na || memcmp(a, c, na))))
+        fail("utf7_canonicalize lenient", data, len);
+
+    /* UTF-8 */
+    decode8_ref(&ref, data, len);
+    decode8_block(&alt, data, len, &rng);
+    compare("utf8_decode_block", &ref, &alt, 0, data, len);
+    na = encode8_ref(a, cp, n);
+    nb = encode8_block(b, cp, n, &rng);
+    if (na != nb || memcmp(a, b, na))
+        fail("utf8_encode_block", data, len);
+
+    return 0;
+}
+
+int
+LLVMFuzzerTestOneInput(const unsigned char *data, size_t len)
+{
+    return fuzz_one(data, len);
+}
+
+#ifndef FUZZ_NO_MAIN
+/* Generate input that is likely to reach deep into the codecs: valid
+ * UTF-7 and UTF-8 with a few mutations, or soup from their alphabets.
+ */
+static size_t
+generate(unsigned char *buf, struct rng *rng)
+{
+    static const char soup[] =
+        "++++----AAAA////0123abcxyzABCXYZ2D3cqQ \t\n=~\\!";
+    size_t i, n = 1 + rng_next(rng) % 256;
+    long cp[256];
+    char tmp[MAXOUT];
+    size_t len;
+
+    switch (rng_next(rng) % 3) {
+        case 0:
+            for (i = 0; i < n; i++)
+                buf[i] = soup[rng_next(rng) % (sizeof(soup) - 1)];
+            return n;
+        case 1:
+            for (i = 0; i < n; i++) {
+                switch (rng_next(rng) % 4) {
+                    case 0: cp[i] = rng_next(rng) % 0x80; break;
+                    case 1: cp[i] = rng_next(rng) % 0x800; break;
+                    case 2: cp[i] = rng_next(rng) % 0xd800; break;
+                    case 3: cp[i] = 0x10000L + rng_next(rng) % 0x10000L; break;
+                }
+            }
+            if (rng_next(rng) % 2)
+                len = encode7_ref(tmp, cp, n, 0);
+            else
+                len = encode8_ref(tmp, cp, n);
+            memcpy(buf, tmp, len);
+            for (i = rng_next(rng) % 3; i; i--)
+                buf[rng_next(rng) % len] = soup[rng_next(rng) % 8];
+            return len;
+        default:
+            for (i = 0; i < n; i++)
+                buf[i] = rng_next(rng);
+            return n;
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    static unsigned char buf[MAXIN];
+    int i;
+
+    if (argc > 1 && strcmp(argv[1], "-n")) {
+        for (i = 1; i < argc; i++) {
+            size_t len;
+            FILE *f = fopen(argv[i], "rb");
+            if (!f) {
+                fprintf(stderr, "fuzz: could not open %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            len = fread(buf, 1, sizeof(buf), f);
+            fclose(f);
+            fuzz_one(buf, len);
+        }
+    } else {
+        long n = argc > 2 ? strtol(argv[2], 0, 10) : 200000L;
+        struct rng rng = {1};
+        long j;
+        for (j = 0; j < n; j++)
+            fuzz_one(buf, generate(buf, &rng));
+        printf("fuzz: %ld inputs, no mismatches\n", n);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,200 @@
+/* Search UTF-7 text on standard input without decoding it first
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Prints each line containing the pattern, given in UTF-8, much like
+ * grep -F. Lines are independent in UTF-7, since a newline always ends a
+ * shifted encoding, so each is searched on its own. Exits with 0 when
+ * something matched, 1 when nothing did, and 2 on error.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf8.h"
+#include "getopt.h"
+#include "../utf7.h"
+
+#define BUFLEN 65536
+
+/* Print an error message and immediately exit with a failure.
+ *
+ * If the format string begins with a colon, don't prefix the program
+ * name to the error message. If the format string ends with a colon,
+ * append strerror(errno) to the end of the message.
+ */
+static void
+die(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if (*fmt == ':')
+        fmt++;
+    else
+        fprintf(stderr, "grep7: ");
+    vfprintf(stderr, fmt, ap);
+    if (fmt[strlen(fmt) - 1] == ':')
+        fprintf(stderr, " %s\n", strerror(errno));
+    else
+        fputc('\n', stderr);
+    va_end(ap);
+    exit(2);
+}
+
+static void *
+xrealloc(void *p, size_t n)
+{
+    p = realloc(p, n);
+    if (!p)
+        die("out of memory");
+    return p;
+}
+
+/* Decode the UTF-8 pattern into a freshly allocated array. */
+static long *
+parse_pattern(const char *s, size_t *len)
+{
+    size_t n = strlen(s);
+    long *cp = xrealloc(0, (n ? n : 1) * sizeof(*cp));
+    struct utf8 ctx;
+    long c;
+
+    utf8_init(&ctx);
+    ctx.buf = (char *)s;
+    ctx.len = n;
+    *len = 0;
+    while ((c = utf8_decode(&ctx)) >= 0)
+        cp[(*len)++] = c;
+    if (c != UTF8_OK)
+        die("pattern is not valid UTF-8");
+    return cp;
+}
+
+static struct {
+    int count;      /* -c */
+    int offsets;    /* -b */
+    int lineno;     /* -n */
+} options;
+
+static void
+usage(FILE *f)
+{
+    fprintf(f, "usage: grep7 [-bchn] PATTERN\n");
+    fprintf(f, "  -b        print byte and code point offsets of matches\n");
+    fprintf(f, "  -c        only print a count of matching lines\n");
+    fprintf(f, "  -h        print this help info\n");
+    fprintf(f, "  -n        print line numbers\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    char *buf = 0;
+    size_t cap = BUFLEN;
+    size_t beg = 0, end = 0;
+    unsigned long lineno = 0;
+    unsigned long byte = 0;         /* offset of the current line */
+    unsigned long codepoint = 0;    /* likewise in code points */
+    unsigned long matches = 0;
+    long *pattern;
+    size_t plen;
+    size_t *table;
+    struct utf7_search search;
+    int option;
+
+    while ((option = getopt(argc, argv, "bchn")) != -1) {
+        switch (option) {
+            case 'b':
+                options.offsets = 1;
+                break;
+            case 'c':
+                options.count = 1;
+                break;
+            case 'h':
+                usage(stdout);
+                exit(EXIT_SUCCESS);
+                break;
+            case 'n':
+                options.lineno = 1;
+                break;
+            default:
+                usage(stderr);
+                exit(2);
+        }
+    }
+    if (!argv[optind])
+        die("missing pattern");
+    if (argv[optind + 1])
+        die("unknown command line argument, '%s'", argv[optind + 1]);
+
+    pattern = parse_pattern(argv[optind], &plen);
+    if (!plen)
+        die("empty pattern");
+    table = xrealloc(0, 2 * plen * sizeof(*table));
+    utf7_search_init(&search, pattern, plen, table);
+    buf = xrealloc(0, cap);
+
+    for (;;) {
+        struct utf7_match m;
+        char *nl = memchr(buf + beg, 0x0a, end - beg);
+        size_t len;
+        int r;
+
+        if (!nl && !feof(stdin)) {
+            /* make room and read more */
+            if (beg) {
+                memmove(buf, buf + beg, end - beg);
+                end -= beg;
+                beg = 0;
+            } else if (end == cap) {
+                cap *= 2;
+                buf = xrealloc(buf, cap);
+            }
+            end += fread(buf + end, 1, cap - end, stdin);
+            if (ferror(stdin))
+                die(":<stdin>:");
+            continue;
+        }
+        if (!nl && beg == end)
+            break;
+
+        len = nl ? (size_t)(nl - buf) + 1 - beg : end - beg;
+        lineno++;
+        r = utf7_search(&search, buf + beg, len, 0, &m);
+        if (r == UTF7_INVALID)
+            die(":<stdin>:%lu: invalid input", lineno);
+        if (r == UTF7_INCOMPLETE)
+            die(":<stdin>:%lu: truncated input", lineno);
+
+        if (r) {
+            matches++;
+            if (!options.count) {
+                if (options.lineno)
+                    printf("%lu:", lineno);
+                if (options.offsets)
+                    printf("%lu:%lu:", byte + m.byte,
+                           codepoint + m.codepoint);
+                if (!fwrite(buf + beg, len, 1, stdout))
+                    die(":<stdout>:");
+                if (!nl)
+                    putchar(0x0a);
+            }
+            /* count the rest of the line */
+            if (options.offsets)
+                utf7_search(&search, buf + beg, len, (unsigned long)-1, &m);
+        }
+        byte += len;
+        codepoint += m.codepoint;
+        beg += len;
+    }
+
+    if (options.count)
+        printf("%lu\n", matches);
+    if (fflush(stdout) == EOF)
+        die(":<stdout>:");
+    free(buf);
+    free(table);
+    free(pattern);
+    return matches ? 0 : 1;
+}
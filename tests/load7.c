@@ -0,0 +1,480 @@
+/* Load generator for conv7d
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Keeps a fixed number of conversions in flight against the daemon from
+ * a single epoll loop, checks every reply against the library's own
+ * output, and reports latency percentiles and throughput, followed by
+ * the daemon's own counters. Needs POSIX sockets and Linux epoll.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "utf8.h"
+#include "../utf7.h"
+
+#define NMSG     8      /* distinct messages, cycled through */
+#define NBUCKET  128    /* latency histogram buckets */
+#define BUFLEN   65536
+
+/* A prepared request and the output it must produce. */
+struct message {
+    char *req;
+    size_t reqlen;
+    char *want;
+    size_t wantlen;
+};
+
+struct client {
+    int fd;
+    const struct message *m;
+    size_t sent;            /* bytes of the request written */
+    size_t got;             /* bytes of output matched so far */
+    unsigned char hdr[4];   /* frame length being read */
+    int nhdr;
+    size_t frame;           /* bytes left in the current frame */
+    int ended;              /* end frame seen, reading the status */
+    char status[64];
+    size_t nstatus;
+    int bad;
+    struct timespec start;
+};
+
+static struct message messages[NMSG];
+static struct sockaddr_un addr;
+static int epfd;
+
+static unsigned long latency[NBUCKET];
+static unsigned long ok, failed;
+static double bytes_in, bytes_out;
+
+static void
+die(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "load7: ");
+    vfprintf(stderr, fmt, ap);
+    if (fmt[strlen(fmt) - 1] == ':')
+        fprintf(stderr, " %s\n", strerror(errno));
+    else
+        fputc('\n', stderr);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+static void *
+xmalloc(size_t n)
+{
+    void *p = malloc(n);
+    if (!p)
+        die("out of memory");
+    return p;
+}
+
+static double
+elapsed(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - since->tv_sec) +
+           (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* Log-scaled buckets, four per power of two of microseconds. */
+static int
+bucket(double secs)
+{
+    unsigned long us = (unsigned long)(secs * 1e6);
+    int b = 0;
+    if (us < 4)
+        return (int)us;
+    while (us >> (b + 1))
+        b++;
+    b = b * 4 + (int)((us >> (b - 2)) & 3);
+    return b < NBUCKET ? b : NBUCKET - 1;
+}
+
+static unsigned long
+bucket_floor(int b)
+{
+    if (b < 4)
+        return b;
+    return (4UL | (b & 3)) << (b / 4 - 2);
+}
+
+/* The lower bound of the bucket holding the given fraction. */
+static unsigned long
+percentile(const unsigned long *hist, double p)
+{
+    unsigned long total = 0, seen = 0;
+    int b;
+    for (b = 0; b < NBUCKET; b++)
+        total += hist[b];
+    for (b = 0; b < NBUCKET; b++) {
+        seen += hist[b];
+        if (total && seen >= p * total)
+            return bucket_floor(b);
+    }
+    return 0;
+}
+
+static unsigned long
+rng(unsigned long *s)
+{
+    *s = (*s * 1103515245UL + 12345UL) & 0xffffffffUL;
+    return *s >> 16;
+}
+
+/* Text in words of mixed scripts, or only Latin-1 when narrow. */
+static void
+generate(long *cp, size_t n, unsigned long seed, int narrow)
+{
+    static const long ranges[][2] = {
+        {0x61, 0x7a}, {0xe0, 0xff}, {0x3b1, 0x3c9}, {0x430, 0x44f},
+        {0x4e00, 0x9fff}, {0x1f600, 0x1f64f}
+    };
+    unsigned long s = seed;
+    size_t i = 0;
+    while (i < n) {
+        int r = narrow ? rng(&s) % 2 : rng(&s) % 6;
+        size_t len = 1 + rng(&s) % 8;
+        if (r > 1 && rng(&s) % 2)
+            r = 0;
+        while (len-- && i < n) {
+            long lo = ranges[r][0], hi = ranges[r][1];
+            cp[i++] = lo + (long)(rng(&s) % (hi - lo + 1));
+        }
+        if (i < n)
+            cp[i++] = rng(&s) % 8 ? 0x20 : rng(&s) % 2 ? 0x0a : 0x2b;
+    }
+}
+
+enum encoding {UTF7, UTF8, LATIN1};
+
+static size_t
+encode(char *buf, size_t len, const long *cp, size_t n, enum encoding e)
+{
+    size_t i;
+    struct utf7 u7;
+    struct utf8 u8;
+    switch (e) {
+        case UTF7:
+            utf7_init(&u7, 0);
+            u7.buf = buf;
+            u7.len = len;
+            for (i = 0; i < n; i++)
+                utf7_encode(&u7, cp[i]);
+            utf7_encode(&u7, UTF7_FLUSH);
+            return u7.buf - buf;
+        case UTF8:
+            utf8_init(&u8);
+            u8.buf = buf;
+            u8.len = len;
+            for (i = 0; i < n; i++)
+                utf8_encode(&u8, cp[i]);
+            return u8.buf - buf;
+        case LATIN1:
+            for (i = 0; i < n; i++)
+                buf[i] = (char)cp[i];
+            return n;
+    }
+    return 0;
+}
+
+/* Each pair of directions gets two messages. */
+static void
+prepare(size_t ncp)
+{
+    static const struct {
+        const char *line;
+        enum encoding fr, to;
+    } kinds[] = {
+        {"utf-8 utf-7\n", UTF8, UTF7},
+        {"utf-7 utf-8\n", UTF7, UTF8},
+        {"latin-1 utf-7\n", LATIN1, UTF7},
+        {"utf-7 latin-1\n", UTF7, LATIN1}
+    };
+    long *cp = xmalloc(ncp * sizeof(*cp));
+    size_t cap = ncp * 8 + 64;
+    int i;
+
+    for (i = 0; i < NMSG; i++) {
+        struct message *m = messages + i;
+        int k = i % 4;
+        size_t hl = strlen(kinds[k].line);
+        generate(cp, ncp, i + 1, kinds[k].fr == LATIN1 ||
+                                 kinds[k].to == LATIN1);
+        m->req = xmalloc(hl + cap);
+        memcpy(m->req, kinds[k].line, hl);
+        m->reqlen = hl + encode(m->req + hl, cap, cp, ncp, kinds[k].fr);
+        m->want = xmalloc(cap);
+        m->wantlen = encode(m->want, cap, cp, ncp, kinds[k].to);
+    }
+    free(cp);
+}
+
+/* Connect, giving a daemon that's just starting up a second to bind. */
+static int
+dial(void)
+{
+    int tries;
+    for (tries = 0;; tries++) {
+        struct timespec ms = {0, 10000000};
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            die("socket:");
+        if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+            return fd;
+        if ((errno != ENOENT && errno != ECONNREFUSED) || tries == 100)
+            die("%s:", addr.sun_path);
+        close(fd);
+        nanosleep(&ms, 0);
+    }
+}
+
+static void
+start(struct client *c, unsigned long n)
+{
+    struct epoll_event e;
+    memset(c, 0, sizeof(*c));
+    c->m = messages + n % NMSG;
+    clock_gettime(CLOCK_MONOTONIC, &c->start);
+    c->fd = dial();
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    e.events = EPOLLIN | EPOLLOUT;
+    e.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &e))
+        die("epoll_ctl:");
+}
+
+/* Check the reply as it streams in, against the expected output. */
+static void
+consume(struct client *c, const char *buf, size_t len)
+{
+    while (len) {
+        size_t n;
+        if (c->ended) {
+            n = sizeof(c->status) - 1 - c->nstatus;
+            n = len < n ? len : n;
+            memcpy(c->status + c->nstatus, buf, n);
+            c->nstatus += n;
+            c->bad |= n < len;
+            return;
+        } else if (c->frame) {
+            n = len < c->frame ? len : c->frame;
+            if (c->got + n > c->m->wantlen ||
+                memcmp(c->m->want + c->got, buf, n))
+                c->bad = 1;
+            c->got += n;
+            c->frame -= n;
+        } else {
+            c->hdr[c->nhdr++] = *buf;
+            n = 1;
+            if (c->nhdr == 4) {
+                c->frame = (size_t)c->hdr[0] << 24 | (size_t)c->hdr[1] << 16 |
+                           (size_t)c->hdr[2] <<  8 | (size_t)c->hdr[3];
+                c->ended = !c->frame;
+                c->nhdr = 0;
+            }
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Returns nonzero when the conversion is over. */
+static int
+service(struct client *c, unsigned events)
+{
+    static char buf[BUFLEN];
+
+    if ((events & EPOLLOUT) && c->sent < c->m->reqlen) {
+        ssize_t r = write(c->fd, c->m->req + c->sent,
+                          c->m->reqlen - c->sent);
+        if (r < 0 && errno != EAGAIN)
+            die("write:");
+        if (r > 0)
+            c->sent += r;
+        if (c->sent == c->m->reqlen) {
+            struct epoll_event e;
+            shutdown(c->fd, SHUT_WR);
+            e.events = EPOLLIN;
+            e.data.ptr = c;
+            if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &e))
+                die("epoll_ctl:");
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP)) {
+        for (;;) {
+            ssize_t r = read(c->fd, buf, sizeof(buf));
+            if (r < 0 && errno == EAGAIN)
+                return 0;
+            if (r < 0)
+                die("read:");
+            if (!r)
+                break;
+            consume(c, buf, r);
+        }
+
+        c->status[c->nstatus] = 0;
+        if (c->bad || !c->ended || c->got != c->m->wantlen ||
+            strcmp(c->status, "ok\n")) {
+            if (!failed)
+                fprintf(stderr, "load7: bad reply, status: %s\n",
+                        c->nstatus ? c->status : "(none)\n");
+            failed++;
+        } else {
+            ok++;
+        }
+        latency[bucket(elapsed(&c->start))]++;
+        bytes_in += c->m->reqlen;
+        bytes_out += c->m->wantlen;
+        close(c->fd);
+        return 1;
+    }
+    return 0;
+}
+
+/* Print the daemon's counters, prefixed to set them apart. */
+static void
+server_stats(void)
+{
+    static char buf[BUFLEN];
+    size_t len = 0;
+    int fd = dial();
+    char *p, *end;
+
+    if (write(fd, "stats\n", 6) != 6)
+        die("write:");
+    shutdown(fd, SHUT_WR);
+    for (;;) {
+        ssize_t r = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (r < 0)
+            die("read:");
+        if (!r)
+            break;
+        len += r;
+    }
+    close(fd);
+    if (len < 4)
+        die("no reply to stats");
+    p = buf + 4;
+    end = p + ((size_t)(unsigned char)buf[0] << 24 |
+               (size_t)(unsigned char)buf[1] << 16 |
+               (size_t)(unsigned char)buf[2] <<  8 |
+               (size_t)(unsigned char)buf[3]);
+    if (end > buf + len)
+        die("short reply to stats");
+    while (p < end) {
+        char *nl = memchr(p, 0x0a, end - p);
+        if (!nl)
+            break;
+        printf("server: %.*s\n", (int)(nl - p), p);
+        p = nl + 1;
+    }
+}
+
+static void
+usage(FILE *f)
+{
+    fprintf(f, "usage: load7 [-h] [-c N] [-m CP] [-n N] [-p PATH]\n");
+    fprintf(f, "  -c N      conversions in flight [100]\n");
+    fprintf(f, "  -h        print this help info\n");
+    fprintf(f, "  -m CP     code points per message [2048]\n");
+    fprintf(f, "  -n N      total conversions [10000]\n");
+    fprintf(f, "  -p PATH   daemon's Unix socket [conv7d.sock]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = "conv7d.sock";
+    unsigned long concurrency = 100;
+    unsigned long total = 10000;
+    unsigned long started = 0, done = 0;
+    size_t ncp = 2048;
+    struct client *clients;
+    struct epoll_event events[256];
+    struct timespec t0;
+    double secs;
+    unsigned long i;
+    int option;
+
+    while ((option = getopt(argc, argv, "c:hm:n:p:")) != -1) {
+        switch (option) {
+            case 'c':
+                concurrency = strtoul(optarg, 0, 10);
+                break;
+            case 'h':
+                usage(stdout);
+                exit(EXIT_SUCCESS);
+                break;
+            case 'm':
+                ncp = strtoul(optarg, 0, 10);
+                break;
+            case 'n':
+                total = strtoul(optarg, 0, 10);
+                break;
+            case 'p':
+                path = optarg;
+                break;
+            default:
+                usage(stderr);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (!concurrency || !ncp)
+        die("-c and -m must be positive");
+    if (strlen(path) >= sizeof(addr.sun_path))
+        die("socket path too long, '%s'", path);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    prepare(ncp);
+    epfd = epoll_create(1);
+    if (epfd < 0)
+        die("epoll_create:");
+    if (concurrency > total)
+        concurrency = total;
+    clients = xmalloc(concurrency * sizeof(*clients));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < concurrency; i++)
+        start(clients + i, started++);
+    while (done < total) {
+        int k, n = epoll_wait(epfd, events, 256, -1);
+        if (n < 0 && errno != EINTR)
+            die("epoll_wait:");
+        for (k = 0; k < n; k++) {
+            struct client *c = events[k].data.ptr;
+            if (service(c, events[k].events)) {
+                done++;
+                if (started < total)
+                    start(c, started++);
+            }
+        }
+    }
+    secs = elapsed(&t0);
+
+    printf("load7: %lu conversions, %lu failed, %lu in flight\n",
+           ok + failed, failed, concurrency);
+    printf("load7: %.3f s, %.0f conversions/s\n", secs, done / secs);
+    printf("load7: %.2f MB/s in, %.2f MB/s out\n",
+           bytes_in / secs / 1e6, bytes_out / secs / 1e6);
+    printf("load7: latency p50 %lu us, p99 %lu us\n",
+           percentile(latency, 0.50), percentile(latency, 0.99));
+    server_stats();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
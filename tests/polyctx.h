@@ -0,0 +1,160 @@
+/* One codec interface over UTF-7, UTF-8, and Latin-1, for conv7 and conv7d
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Every codec context sits in a union polyctx, reached through a common
+ * buf/len prefix, and is driven through the wrap_* functions below.
+ * Latin-1 has no context of its own and uses just that prefix.
+ */
+#ifndef POLYCTX_H
+#define POLYCTX_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "utf8.h"
+#include "../utf7.h"
+
+#define CTX_OK          -1
+#define CTX_FULL        -2
+#define CTX_INCOMPLETE  -3
+#define CTX_INVALID     -4
+
+#define CTX_FLUSH       -1L
+
+#define REPLACEMENT 0xfffdL
+
+union polyctx {
+    struct {
+        char *buf;
+        size_t len;
+    } generic;
+    struct utf7 utf7;
+    struct utf8 utf8;
+};
+
+typedef int  (*encoder)(union polyctx *, long c);
+typedef long (*decoder)(union polyctx *);
+typedef size_t (*spanner)(union polyctx *, const char *, size_t);
+
+static int
+wrap_utf7_encode(union polyctx *ctx, long c)
+{
+    return utf7_encode(&ctx->utf7, c);
+}
+
+static int
+wrap_utf8_encode(union polyctx *ctx, long c)
+{
+    return utf8_encode(&ctx->utf8, c);
+}
+
+static size_t
+wrap_utf7_encode_span(union polyctx *ctx, const char *s, size_t len)
+{
+    return utf7_encode_span(&ctx->utf7, s, len);
+}
+
+static size_t
+wrap_utf8_encode_span(union polyctx *ctx, const char *s, size_t len)
+{
+    return utf8_encode_span(&ctx->utf8, s, len);
+}
+
+static int
+wrap_latin1_encode(union polyctx *ctx, long c)
+{
+    if (c == CTX_FLUSH)
+        return CTX_OK;
+    if (!ctx->generic.len)
+        return CTX_FULL;
+    *ctx->generic.buf++ = (char)c;
+    ctx->generic.len--;
+    return CTX_OK;
+}
+
+static long
+wrap_utf7_decode(union polyctx *ctx)
+{
+    return utf7_decode(&ctx->utf7);
+}
+
+static long
+wrap_utf8_decode(union polyctx *ctx)
+{
+    return utf8_decode(&ctx->utf8);
+}
+
+static long
+wrap_latin1_decode(union polyctx *ctx)
+{
+    if (!ctx->generic.len)
+        return CTX_OK;
+    ctx->generic.len--;
+    return (unsigned char)*ctx->generic.buf++;
+}
+
+static size_t
+wrap_utf7_decode_span(union polyctx *ctx, const char *s, size_t len)
+{
+    return utf7_decode_span(&ctx->utf7, s, len);
+}
+
+static size_t
+wrap_utf8_decode_span(union polyctx *ctx, const char *s, size_t len)
+{
+    return utf8_decode_span(&ctx->utf8, s, len);
+}
+
+/* ASCII is the same in Latin-1, either way. */
+static size_t
+wrap_latin1_span(union polyctx *ctx, const char *s, size_t len)
+{
+    size_t i;
+    (void)ctx;
+    for (i = 0; i < len; i++)
+        if ((unsigned char)s[i] > 0x7f)
+            break;
+    return i;
+}
+
+enum encoding {
+    F_UNKNOWN = 0,
+    F_UTF7,
+    F_UTF8,
+    F_LATIN1
+};
+
+static const struct {
+    const char name[16];
+    enum encoding e;
+} encoding_table[] = {
+    {"7", F_UTF7},
+    {"utf7", F_UTF7},
+    {"utf-7", F_UTF7},
+    {"UTF7", F_UTF7},
+    {"UTF-7", F_UTF7},
+    {"8", F_UTF8},
+    {"utf8", F_UTF8},
+    {"utf-8", F_UTF8},
+    {"UTF8", F_UTF8},
+    {"UTF-8", F_UTF8},
+    {"l1", F_LATIN1},
+    {"latin1", F_LATIN1},
+    {"latin-1", F_LATIN1},
+    {"LATIN1", F_LATIN1},
+    {"LATIN-1", F_LATIN1},
+    {"iso-8859-1", F_LATIN1},
+    {"ISO-8859-1", F_LATIN1}
+};
+
+static enum encoding
+encoding_parse(const char *s)
+{
+    int i, n = sizeof(encoding_table) / sizeof(*encoding_table);
+    for (i = 0; i < n; i++)
+        if (!strcmp(s, encoding_table[i].name))
+            return encoding_table[i].e;
+    return F_UNKNOWN;
+}
+
+#endif
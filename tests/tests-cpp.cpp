@@ -0,0 +1,138 @@
+// Tests for the C++ layer in utf7.hpp
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <list>
+#include <string>
+#include <vector>
+#include "../utf7.hpp"
+
+#if _WIN32
+#  define C_RED(s)     s
+#  define C_GREEN(s)   s
+#else
+#  define C_RED(s)     "\033[31;1m" s "\033[0m"
+#  define C_GREEN(s)   "\033[32;1m" s "\033[0m"
+#endif
+
+static int fails = 0;
+
+static void
+report(const char *name, int n)
+{
+    if (n) {
+        std::printf(C_RED("FAIL") ": %s\n", name);
+        fails++;
+    } else {
+        std::printf(C_GREEN("PASS") ": %s\n", name);
+    }
+}
+
+/* The plain C encoder, as the reference. */
+static std::string
+encode_c(const std::vector<long> &cps, const char *indirect)
+{
+    char buf[1024];
+    struct utf7 ctx;
+    utf7_init(&ctx, indirect);
+    ctx.buf = buf;
+    ctx.len = sizeof(buf);
+    for (long c : cps)
+        utf7_encode(&ctx, c);
+    utf7_encode(&ctx, UTF7_FLUSH);
+    return std::string(buf, ctx.buf - buf);
+}
+
+int
+main()
+{
+    static const std::vector<long> text = {
+        0x48, 0x69, 0x20, 0x4d, 0x6f, 0x6d, 0x20, 0x2d, 0x263a, 0x2d, 0x21,
+        0x20, 0x2b, 0x65e5, 0x672c, 0x8a9e, 0x2e, 0x1f600
+    };
+    const std::string encoded = encode_c(text, nullptr);
+
+    {
+        int n = 0;
+        std::vector<long> got;
+        utf7pp::decode_view v(encoded);
+        for (long c : v)
+            got.push_back(c);
+        n += got != text;
+        n += v.status() != UTF7_OK;
+        n += v.offset() != encoded.size();
+
+        /* post-increment hands back the old code point */
+        utf7pp::decode_view w("a+AGI-c");
+        auto it = w.begin();
+        n += *it++ != 0x61;
+        n += *it != 0x62;
+        report("decode_view", n);
+    }
+
+    {
+        int n = 0;
+        utf7pp::decode_view bad("ok+AGF-");
+        std::size_t count = 0;
+        for (long c : bad)
+            count += c >= 0;
+        n += count != 3 || bad.status() != UTF7_INVALID;
+        utf7pp::decode_view cut("ok+AGE");
+        for (long c : cut)
+            (void)c;
+        n += cut.status() != UTF7_INCOMPLETE;
+        report("decode_view errors", n);
+    }
+
+    {
+        int n = 0;
+        std::string s;
+        std::vector<char> vec;
+        utf7pp::encode(text, std::back_inserter(s));
+        utf7pp::encode(text, std::back_inserter(vec), "!");
+        n += s != encoded;
+        n += std::string(vec.begin(), vec.end()) != encode_c(text, "!");
+
+        utf7pp::encode_iterator it(std::back_inserter(s));
+        s.clear();
+        for (long c : text)
+            *it++ = c;
+        it.finish();
+        n += s != encoded;
+        report("encode to an output iterator", n);
+    }
+
+    {
+        int n = 0;
+        char buf[64];
+        utf7pp::encode_result r = utf7pp::encode_into(text, buf, sizeof(buf));
+        n += r.status != UTF7_OK || r.read != text.size();
+        n += std::string(buf, r.written) != encoded;
+        r = utf7pp::encode_into(text, buf, 10);
+        n += r.status != UTF7_FULL || r.read == text.size();
+        n += r.written > 10 || std::memcmp(buf, encoded.data(), r.written);
+        report("encode into a buffer", n);
+    }
+
+    {
+        int n = 0;
+        std::string s = "prefix:";
+        std::list<long> once(text.begin(), text.end());
+        utf7pp::encode_to(s, text);
+        n += s != "prefix:" + encoded;
+        s.clear();
+        utf7pp::encode_to(s, once);
+        n += s != encoded;
+
+        /* indirect ASCII outgrows the estimate */
+        std::vector<long> tildes(100, 0x7e);
+        s.clear();
+        utf7pp::encode_to(s, tildes);
+        n += s != encode_c(tildes, nullptr);
+        n += utf7pp::encoded_size(text) < encoded.size();
+        report("encode_to", n);
+    }
+
+    return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -171,6 +171,60 @@ decode_chunker(const char *in, const long *expect)
     return 0;
 }
 
+/* A sink and source over a memory buffer, a byte at a time for input. */
+struct memio {
+    char *p;
+    size_t len;
+};
+
+static int
+mem_sink(void *user, const char *buf, size_t len)
+{
+    struct memio *m = user;
+    if (len > m->len)
+        return 1;
+    memcpy(m->p, buf, len);
+    m->p += len;
+    m->len -= len;
+    return 0;
+}
+
+static long
+mem_source(void *user, char *buf, size_t len)
+{
+    struct memio *m = user;
+    if (!m->len || !len)
+        return 0;
+    *buf = *m->p++;
+    m->len--;
+    return 1;
+}
+
+struct counted {
+    struct utf7_arena arena;
+    int calls;
+};
+
+static void *
+counted_alloc(void *user, size_t size)
+{
+    struct counted *c = user;
+    c->calls++;
+    return utf7_arena_alloc(&c->arena, size);
+}
+
+/* Concatenate output chunks, returning the total length. */
+static size_t
+gather(const struct utf7_output *out, void *dst)
+{
+    size_t i, n = 0;
+    for (i = 0; i < out->count; i++) {
+        memcpy((char *)dst + n, out->iov[i].base, out->iov[i].len);
+        n += out->iov[i].len;
+    }
+    return n;
+}
+
 int
 main(void)
 {
@@ -390,6 +444,740 @@ main(void)
             printf(C_GREEN("PASS") ": %s\n", name);
     }
 
+    {
+        size_t r[4];
+        char name[] = "direct spans";
+        char in[] = "a=b+AGE-c";
+        char out[8];
+        struct utf7 ctx[1];
+        utf7_init(ctx, "=");
+        ctx->buf = out;
+        ctx->len = sizeof(out);
+        r[0] = utf7_encode_span(ctx, in, sizeof(in) - 1);
+        r[1] = utf7_decode_span(ctx, in, sizeof(in) - 1);
+        utf7_encode(ctx, 0x03c0);
+        r[2] = utf7_encode_span(ctx, in, sizeof(in) - 1);
+        utf7_init(ctx, 0);
+        ctx->buf = in + 3;
+        ctx->len = 1;
+        utf7_decode(ctx);
+        r[3] = utf7_decode_span(ctx, "AGE", 3);
+        if (r[0] != 1 || r[1] != 3 || r[2] != 0 || r[3] != 0) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        long r[8];
+        int i, n = 0;
+        char name[] = "lenient decode";
+        char in[] = "a\xff" "b+2D0-c+-+ +2D3YAdwB-";
+        long want[] = {0x61, 0xfffd, 0x62, 0xfffd, 0x63, 0x2b,
+                       0xfffd, 0x20};
+        struct utf7_error e[2];
+        struct utf7_lenient l;
+        struct utf7 ctx[1];
+        utf7_init(ctx, 0);
+        utf7_lenient(ctx, &l, 0xfffd, e, 2);
+        ctx->buf = in;
+        ctx->len = sizeof(in) - 1;
+        for (i = 0; i < 8; i++)
+            if ((r[i] = utf7_decode(ctx)) != want[i])
+                n++;
+        /* high surrogate followed by a high: keep the second one */
+        if (utf7_decode(ctx) != 0xfffd || utf7_decode(ctx) != 0x10401L)
+            n++;
+        if (utf7_decode(ctx) != UTF7_OK || l.count != 4)
+            n++;
+        if (e[0].offset != 1 || e[0].length != 1 ||
+            e[0].kind != UTF7_E_BYTE)
+            n++;
+        if (e[1].offset != 3 || e[1].length != 5 ||
+            e[1].kind != UTF7_E_PAIR)
+            n++;
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        int n = 0;
+        char name[] = "writer and reader callbacks";
+        long in[] = {0x61, 0x2b, 0x1f4a9L, 0x62, 0x3c0, 0x3c0, 0x2e};
+        char expect[] = "a+-+2D3cqQ-b+A8ADwA.";
+        char out[64] = {0};
+        char stage[UTF7_MAX_ENCODE];
+        struct memio m;
+        struct utf7_writer w;
+        struct utf7_reader r;
+        size_t i, size;
+
+        m.p = out;
+        m.len = sizeof(out) - 1;
+        utf7_writer_init(&w, 0, stage, sizeof(stage), mem_sink, &m);
+        for (i = 0; i < sizeof(in) / sizeof(*in); i++)
+            if (utf7_write(&w, in[i]) != UTF7_OK)
+                n++;
+        if (utf7_write(&w, UTF7_FLUSH) != UTF7_OK || strcmp(out, expect))
+            n++;
+
+        m.p = out;
+        m.len = strlen(out);
+        utf7_reader_init(&r, stage, sizeof(stage), mem_source, &m);
+        for (i = 0; i < sizeof(in) / sizeof(*in); i++)
+            if (utf7_read(&r) != in[i])
+                n++;
+        if (utf7_read(&r) != UTF7_OK)
+            n++;
+
+        m.p = out;
+        m.len = 4;
+        utf7_writer_init(&w, 0, stage, sizeof(stage), mem_sink, &m);
+        for (i = 0; i < 8; i++)
+            utf7_write(&w, 0x3c0);
+        if (utf7_write(&w, UTF7_FLUSH) != UTF7_ABORT)
+            n++;
+
+        /* stages smaller than UTF7_MAX_ENCODE drain more often */
+        for (size = 1; size < UTF7_MAX_ENCODE; size++) {
+            memset(out, 0, sizeof(out));
+            m.p = out;
+            m.len = sizeof(out) - 1;
+            utf7_writer_init(&w, 0, stage, size, mem_sink, &m);
+            for (i = 0; i < sizeof(in) / sizeof(*in); i++)
+                if (utf7_write(&w, in[i]) != UTF7_OK)
+                    n++;
+            if (utf7_write(&w, UTF7_FLUSH) != UTF7_OK || strcmp(out, expect))
+                n++;
+        }
+        utf7_writer_init(&w, 0, stage, 0, mem_sink, &m);
+        if (utf7_write(&w, 0x3c0) != UTF7_FULL)
+            n++;
+
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        int n = 0;
+        char name[] = "batch encode and decode";
+        long in[] = {0x61, 0x62, 0x3c0, 0x2b, 0x1f4a9L};
+        size_t in_off[] = {0, 2, 2, 4, 5};
+        char expect[] = "ab+A8AAKw-+2D3cqQ-";
+        size_t expect_off[] = {0, 2, 2, 10, 18};
+        size_t part_off[] = {0, 2, 4, 8};
+        char out[32];
+        long back[8];
+        size_t out_off[5], back_off[5], done;
+        struct utf7 ctx[1];
+        utf7_init(ctx, 0);
+        if (utf7_encode_batch(ctx, in, in_off, 4, out, sizeof(out),
+                              out_off, &done) != UTF7_OK || done != 4)
+            n++;
+        if (memcmp(out, expect, 18) || memcmp(out_off, expect_off,
+                                              sizeof(expect_off)))
+            n++;
+        if (utf7_decode_batch(out, out_off, 4, back, 8, back_off,
+                              &done) != UTF7_OK || done != 4)
+            n++;
+        if (memcmp(back, in, sizeof(in)) || memcmp(back_off, in_off,
+                                                   sizeof(in_off)))
+            n++;
+        if (utf7_encode_batch(ctx, in, in_off, 4, out, 12,
+                              out_off, &done) != UTF7_FULL || done != 3)
+            n++;
+        if (utf7_decode_batch("ab+-+AGE", part_off, 3, back, 8,
+                              back_off, &done) != UTF7_INCOMPLETE ||
+            done != 2 || back[2] != 0x2b)
+            n++;
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        char name[] = "compact state";
+        static const struct utf7_state zero;
+        struct utf7_set set;
+        struct utf7_state state[2];
+        struct utf7 ctx[1];
+        char out[2][32] = {{0}, {0}};
+        char *p[2];
+        long in[2][5] = {
+            {0x3c0, 0x1f4a9L, 0x3d, 0x61, UTF7_FLUSH},
+            {0x61, 0x3d, 0x1f4a9L, 0x3c0, UTF7_FLUSH}
+        };
+        int i, j;
+
+        utf7_set_init(&set, "=");
+        state[0] = state[1] = zero;
+        p[0] = out[0];
+        p[1] = out[1];
+        utf7_init(ctx, 0);
+        for (i = 0; i < 5; i++) {
+            for (j = 0; j < 2; j++) {
+                /* one working context, two interleaved streams */
+                utf7_load(ctx, &set, state + j);
+                ctx->buf = p[j];
+                ctx->len = 8;
+                utf7_encode(ctx, in[j][i]);
+                p[j] = ctx->buf;
+                utf7_store(ctx, state + j);
+            }
+        }
+        if (strcmp(out[0], "+A8DYPdypAD0-a") ||
+            strcmp(out[1], "a+AD3YPdypA8A-")) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        int n = 0;
+        long r;
+        char name[] = "save and load state";
+        char in[] = "+2D3cqQ-";
+        unsigned char blob[UTF7_STATE_SIZE];
+        static const unsigned char expect[UTF7_STATE_SIZE] = {
+            0x01, 0x68, 0x00, 0x00, 0x00, 0xdc, 0xd8, 0x3d
+        };
+        struct utf7 ctx[1];
+        utf7_init(ctx, 0);
+        ctx->buf = in;
+        ctx->len = 5;
+        if (utf7_decode(ctx) != UTF7_INCOMPLETE)
+            n++;
+        utf7_save_state(ctx, blob);
+        if (memcmp(blob, expect, sizeof(blob)))
+            n++;
+        utf7_init(ctx, 0);
+        if (utf7_load_state(ctx, blob) != UTF7_OK)
+            n++;
+        ctx->buf = in + 5;
+        ctx->len = 3;
+        if ((r = utf7_decode(ctx)) != 0x1f4a9L || utf7_decode(ctx) != UTF7_OK)
+            n++;
+        blob[0] = 0x7f;
+        if (utf7_load_state(ctx, blob) != UTF7_INVALID)
+            n++;
+        if (n) {
+            printf(C_RED("FAIL") ": %s [%ld]\n", name, r);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        int n = 0;
+        char name[] = "checkpoint index";
+        char in[] = "Hi Mom -+Jjo--! A+ImIDkQ. x+2D3cqQ-";
+        unsigned char saved[56 + 24 * 4];
+        struct utf7_checkpoint points[4], loaded[4];
+        const struct utf7_checkpoint *p;
+        struct utf7_index idx;
+        struct utf7 ctx[1];
+        size_t z;
+
+        /* save and reload in the middle of a shifted sequence */
+        utf7_index_init(&idx, points, 4, 4);
+        if (utf7_index_feed(&idx, in, 20) != UTF7_INCOMPLETE)
+            n++;
+        z = utf7_index_save(&idx, saved, sizeof(saved));
+        if (utf7_index_load(&idx, points, 4, saved, z) != UTF7_OK ||
+            utf7_index_feed(&idx, in + 20, sizeof(in) - 21) != UTF7_OK)
+            n++;
+        if (idx.codepoint != 19 || idx.count < 2 || idx.interval != 16)
+            n++;
+        if (utf7_index_save(&idx, saved, 0) != 56 + 24 * idx.count ||
+            utf7_index_save(&idx, saved, sizeof(saved)) > sizeof(saved) ||
+            utf7_index_load(&idx, loaded, 4, saved, sizeof(saved)) != UTF7_OK)
+            n++;
+        if (idx.byte != sizeof(in) - 1 || idx.codepoint != 19)
+            n++;
+
+        /* code point 18 is the U+1F4A9 at the end */
+        p = utf7_index_find(&idx, 18);
+        utf7_init(ctx, 0);
+        if (!p || utf7_index_seek(ctx, p) != UTF7_OK) {
+            n++;
+        } else {
+            unsigned long k;
+            ctx->buf = in + p->byte;
+            ctx->len = sizeof(in) - 1 - p->byte;
+            for (k = p->codepoint; k < 18; k++)
+                utf7_decode(ctx);
+            if (p->byte < 16 || utf7_decode(ctx) != 0x1f4a9L)
+                n++;
+        }
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        int n = 0;
+        char name[] = "search encoded text";
+        char in[] = "Hi Mom -+Jjo--! A+ImIDkQ. x+2D3cqQ- Mom+-";
+        long smile[] = {0x263a, 0x2d};
+        long mom[] = {0x4d, 0x6f, 0x6d};
+        long alpha[] = {0x391, 0x2e};
+        long none[] = {0x61, 0x62, 0x63};
+        size_t table[6];
+        struct utf7_search s;
+        struct utf7_match m;
+
+        utf7_search_init(&s, smile, 2, table);
+        if (utf7_search(&s, in, sizeof(in) - 1, 0, &m) != 1 ||
+            m.byte != 9 || m.codepoint != 8)
+            n++;
+        utf7_search_init(&s, mom, 3, table);
+        if (utf7_search(&s, in, sizeof(in) - 1, 4, &m) != 1 ||
+            m.byte != 36 || m.codepoint != 20)
+            n++;
+        utf7_search_init(&s, alpha, 2, table);
+        if (utf7_search(&s, in, sizeof(in) - 1, 0, &m) != 1 ||
+            m.byte != 20 || m.codepoint != 14)
+            n++;
+        utf7_search_init(&s, none, 3, table);
+        if (utf7_search(&s, in, sizeof(in) - 1, 0, &m) != 0 ||
+            m.byte != sizeof(in) - 1 || m.codepoint != 24)
+            n++;
+        if (utf7_search(&s, "+AGE", 4, 0, &m) != UTF7_INCOMPLETE ||
+            utf7_search(&s, "+AGF-", 5, 0, &m) != UTF7_INVALID)
+            n++;
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        static const struct {
+            const char *a, *b;
+            int order;
+        } cases[] = {
+            {"abc", "+AGEAYgBj-", 0},
+            {"A+ImIDkQ.", "A+ImIDkQAu-", 0},
+            {"+AGE-x", "ax", 0},
+            {"+2D3cqQ.", "+2D3cqQ-.", 0},
+            {"+ImI-", "+ImIDkQ-", -1},
+            {"Hi+ACE-", "Hi.", -1},
+            {"+2D3cqQ-", "+//8-", 1},
+            {"", "+-", -1}
+        };
+        char name[] = "compare spellings";
+        int i, order, n = 0;
+        for (i = 0; i < (int)(sizeof(cases) / sizeof(*cases)); i++) {
+            const char *a = cases[i].a;
+            const char *b = cases[i].b;
+            if (utf7_compare(a, strlen(a), b, strlen(b), &order) != UTF7_OK ||
+                order != cases[i].order ||
+                utf7_equal(a, strlen(a), b, strlen(b)) != !cases[i].order)
+                n++;
+        }
+        if (utf7_compare("+AGF-", 5, "a", 1, &order) != UTF7_INVALID)
+            n++;
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        static const long frags[][3] = {
+            {0x61, 0xe9, -1}, {0xe9, 0x2b, -1}, {0x2e, 0x263a, -1},
+            {-1}, {0x1f600, -1}, {0x62, 0x2b, -1}
+        };
+        static const char want[] = "a+AOkA6QAr.+JjrYPd4A-b+-";
+        char name[] = "join fragments";
+        char out[64], frag[16], copy[64];
+        int i, j, n = 0;
+        struct utf7 ctx, enc;
+        struct utf7_seam seam, fseam;
+
+        utf7_init(&ctx, 0);
+        ctx.buf = out;
+        ctx.len = sizeof(out);
+        utf7_seam_init(&seam);
+        for (i = 0; i < (int)(sizeof(frags) / sizeof(*frags)); i++) {
+            size_t len;
+            utf7_init(&enc, 0);
+            enc.buf = frag;
+            enc.len = sizeof(frag);
+            for (j = 0; frags[i][j] >= 0; j++)
+                utf7_encode(&enc, frags[i][j]);
+            if (utf7_finish(&enc, &fseam) != UTF7_OK)
+                n++;
+            len = enc.buf - frag;
+
+            /* a full buffer leaves the joined text untouched */
+            memcpy(copy, out, ctx.buf - out);
+            ctx.len = 0;
+            if (len && (utf7_append(&ctx, &seam, frag, len, &fseam) !=
+                        UTF7_FULL || memcmp(copy, out, ctx.buf - out)))
+                n++;
+            ctx.len = sizeof(out) - (ctx.buf - out);
+
+            if (utf7_append(&ctx, &seam, frag, len, &fseam) != UTF7_OK)
+                n++;
+        }
+        if (ctx.buf - out != (int)sizeof(want) - 1 ||
+            memcmp(out, want, sizeof(want) - 1) || seam.open)
+            n++;
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        static const struct {
+            const char *in, *out;
+        } cases[] = {
+            {"Hi Mom -+Jjo--!", "Hi Mom -+Jjo--+ACE-"},
+            {"+AGEAYgBj-", "abc"},
+            {"+ACs-x", "+-x"},
+            {"+AOk-+AOk-.", "+AOkA6Q."},
+            {"+AOk-.", "+AOk."},
+            {"+AOkAKw-", "+AOkAKw-"},
+            {"~+ZeVnLIqe-", "+AH5l5Wcsip4-"},
+            {"a+-b+2D3eAA-", "a+-b+2D3eAA-"}
+        };
+        char name[] = "canonicalize";
+        char out[64];
+        int i, k, r, n = 0;
+        for (i = 0; i < (int)(sizeof(cases) / sizeof(*cases)); i++) {
+            struct utf7 enc, dec;
+            utf7_init(&enc, "!");
+            utf7_init(&dec, 0);
+            enc.buf = out;
+            enc.len = sizeof(out);
+            dec.buf = (char *)cases[i].in;
+            dec.len = strlen(cases[i].in);
+            if (utf7_canonicalize(&enc, &dec) != UTF7_OK ||
+                utf7_encode(&enc, UTF7_FLUSH) != UTF7_OK ||
+                enc.buf - out != (int)strlen(cases[i].out) ||
+                memcmp(out, cases[i].out, enc.buf - out))
+                n++;
+
+            /* again, one byte of output at a time */
+            utf7_init(&enc, "!");
+            utf7_init(&dec, 0);
+            enc.buf = out;
+            dec.buf = (char *)cases[i].in;
+            dec.len = strlen(cases[i].in);
+            for (k = 0; k < 64; k++) {
+                enc.len = 1;
+                r = utf7_canonicalize(&enc, &dec);
+                if (r != UTF7_FULL)
+                    break;
+            }
+            for (; r == UTF7_OK && k < 64; k++) {
+                enc.len = 1;
+                if (utf7_encode(&enc, UTF7_FLUSH) == UTF7_OK)
+                    break;
+            }
+            if (r != UTF7_OK || k == 64 ||
+                enc.buf - out != (int)strlen(cases[i].out) ||
+                memcmp(out, cases[i].out, enc.buf - out))
+                n++;
+        }
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        static const struct {
+            const char *in;
+            int verdict;
+            int confidence;
+        } cases[] = {
+            {"Hello, world!", UTF7_SNIFF_ASCII, 100},
+            {"1 + 1 = 2, C+-", UTF7_SNIFF_ASCII, 100},
+            {"Hi Mom -+Jjo--!", UTF7_SNIFF_UTF7, 50},
+            {"+ZeVnLIqe- +ZeVnLIqe- +ZeVnLIqe-", UTF7_SNIFF_UTF7, 75},
+            {"a+bc d+2D3eAA-", UTF7_SNIFF_ASCII, 66},
+            {"+AGEAYgBj-", UTF7_SNIFF_ASCII, 100},
+            {"+2D0-", UTF7_SNIFF_ASCII, 100},
+            {"+Jjo- caf\xc3\xa9", UTF7_SNIFF_OTHER, 100},
+            {"trailing +ZeVn", UTF7_SNIFF_ASCII, 100}
+        };
+        char name[] = "sniff";
+        char many[16 * 6 + 2];
+        int i, n = 0;
+        struct utf7_sniff r;
+        for (i = 0; i < (int)(sizeof(cases) / sizeof(*cases)); i++) {
+            const char *in = cases[i].in;
+            if (utf7_sniff(in, strlen(in), &r) != cases[i].verdict ||
+                r.verdict != cases[i].verdict ||
+                r.confidence != cases[i].confidence)
+                n++;
+        }
+        /* stops early once the answer is clear */
+        for (i = 0; i < 16; i++)
+            memcpy(many + i * 6, "+Jjo- ", 6);
+        memcpy(many + 16 * 6, "\xff", 2);
+        if (utf7_sniff(many, sizeof(many) - 1, &r) != UTF7_SNIFF_UTF7 ||
+            r.scanned != 16 * 6 - 1 || r.good != 16 || r.confidence != 94)
+            n++;
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        static const char latin1[] =
+            "Caf\xe9 cr\xe8me +\xbd \xe0\xe9\xee\xf5\xfc-x ~\xff\xa0.";
+        char name[] = "latin-1";
+        char want[128], out[128];
+        size_t i, size, len = sizeof(latin1) - 1;
+        long r;
+        int n = 0;
+        struct utf7 ctx;
+
+        /* same as utf7_encode() byte by byte, whatever the buffer size */
+        utf7_init(&ctx, 0);
+        ctx.buf = want;
+        ctx.len = sizeof(want);
+        for (i = 0; i < len; i++)
+            utf7_encode(&ctx, (unsigned char)latin1[i]);
+        utf7_encode(&ctx, UTF7_FLUSH);
+        size = ctx.buf - want;
+        for (i = 1; i <= 9; i++) {
+            size_t off = 0;
+            utf7_init(&ctx, 0);
+            ctx.buf = out;
+            ctx.len = i;
+            while (off < len) {
+                off += utf7_encode_latin1(&ctx, latin1 + off, len - off);
+                if (ctx.len)
+                    n += off != len;
+                ctx.len = i;
+            }
+            ctx.len = sizeof(out) - (ctx.buf - out);
+            utf7_encode(&ctx, UTF7_FLUSH);
+            n += (size_t)(ctx.buf - out) != size || memcmp(out, want, size);
+        }
+
+        /* and back, stopping at what Latin-1 can't represent */
+        utf7_init(&ctx, 0);
+        ctx.buf = want;
+        ctx.len = size;
+        i = sizeof(out);
+        r = utf7_decode_latin1(&ctx, out, &i);
+        n += r != UTF7_OK || i != len || memcmp(out, latin1, len);
+        utf7_init(&ctx, 0);
+        ctx.buf = (char *)"\xe9+AOkmOg-!";
+        ctx.len = 10;
+        i = 2;
+        r = utf7_decode_latin1(&ctx, out, &i);
+        n += r != UTF7_INVALID || i != 0;
+        ctx.buf++;
+        ctx.len--;
+        r = utf7_decode_latin1(&ctx, out, &i);
+        n += r != UTF7_FULL || i != 0;
+        i = 2;
+        r = utf7_decode_latin1(&ctx, out, &i);
+        n += r != 0x263a || i != 1 || out[0] != (char)0xe9;
+        i = 2;
+        r = utf7_decode_latin1(&ctx, out, &i);
+        n += r != UTF7_OK || i != 1 || out[0] != 0x21;
+
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        char name[] = "alloc";
+        static long mem[1L << 15];
+        static long in[4096], got[4096];
+        static char want[16384], out[16384];
+        size_t i, size, len = sizeof(in) / sizeof(*in);
+        struct counted a;
+        struct utf7_output o;
+        struct utf7 ctx;
+        int r, n = 0;
+
+        /* ASCII at first, so the estimate is short and chunks chain */
+        for (i = 0; i < len; i++)
+            in[i] = i < 300 ? 0x61 + (long)(i % 26) :
+                    i % 5 == 4 ? 0x1f600L + (long)i : 0x65e5 + (long)i;
+        utf7_init(&ctx, 0);
+        ctx.buf = want;
+        ctx.len = sizeof(want);
+        for (i = 0; i < len; i++)
+            utf7_encode(&ctx, in[i]);
+        utf7_encode(&ctx, UTF7_FLUSH);
+        size = ctx.buf - want;
+
+        a.arena.beg = (char *)mem;
+        a.arena.end = (char *)(mem + sizeof(mem) / sizeof(*mem));
+        a.calls = 0;
+        utf7_init(&ctx, 0);
+        r = utf7_encode_alloc(&ctx, in, len, 0, counted_alloc, &a, &o);
+        n += r != UTF7_OK || o.count < 2 || o.total != size;
+        n += gather(&o, out) != size || memcmp(out, want, size);
+        n += a.calls != (int)o.count + 1;
+        utf7_init(&ctx, 0);
+        r = utf7_encode_alloc(&ctx, in, len, UTF7_GATHER,
+                              counted_alloc, &a, &o);
+        n += r != UTF7_OK || o.count != 1 || o.total != size;
+        n += memcmp(o.iov[0].base, want, size);
+
+        /* decoding never overshoots the input much */
+        utf7_init(&ctx, 0);
+        ctx.buf = want;
+        ctx.len = size;
+        r = utf7_decode_alloc(&ctx, UTF7_GATHER, counted_alloc, &a, &o);
+        n += r != UTF7_OK || o.count != 1 || o.total != sizeof(in);
+        n += memcmp(o.iov[0].base, in, sizeof(in));
+        utf7_init(&ctx, 0);
+        ctx.buf = (char *)"abc+AGE";
+        ctx.len = 7;
+        r = utf7_decode_alloc(&ctx, 0, counted_alloc, &a, &o);
+        n += r != UTF7_INCOMPLETE || gather(&o, got) != 4 * sizeof(long);
+        n += got[0] != 0x61 || got[3] != 0x61;
+
+        /* nothing to write, and nothing to allocate it with */
+        utf7_init(&ctx, 0);
+        r = utf7_encode_alloc(&ctx, in, 0, 0, counted_alloc, &a, &o);
+        n += r != UTF7_OK || o.count != 0 || o.total != 0;
+        a.arena.end = a.arena.beg + 200;
+        utf7_init(&ctx, 0);
+        r = utf7_encode_alloc(&ctx, in, len, 0, counted_alloc, &a, &o);
+        n += r != UTF7_ABORT || o.count != 0;
+
+        if (n) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
+    {
+        char name[] = "edit";
+        static long text[4096], edited[4096];
+        static char doc[16384], want[16384], out[16384];
+        struct utf7_checkpoint points[64];
+        struct utf7_index idx;
+        struct utf7_splice sp;
+        struct utf7 ctx;
+        size_t i, len, wlen, nlen, n = sizeof(text) / sizeof(*text);
+        long word[] = {0x263a, 0x263b};
+        int r, k = 0;
+
+        /* mostly ASCII, with the odd shifted segment */
+        for (i = 0; i < n; i++)
+            text[i] = i % 97 < 3 ? 0x3b1 + (long)(i % 97) :
+                      0x61 + (long)(i % 23);
+        utf7_init(&ctx, 0);
+        ctx.buf = doc;
+        ctx.len = sizeof(doc);
+        for (i = 0; i < n; i++)
+            utf7_encode(&ctx, text[i]);
+        utf7_encode(&ctx, UTF7_FLUSH);
+        len = ctx.buf - doc;
+        utf7_index_init(&idx, points, 64, 256);
+        utf7_index_feed(&idx, doc, len);
+
+        /* replace code points 2000 and 2001, touching only a few bytes */
+        memcpy(edited, text, sizeof(text));
+        edited[2000] = word[0];
+        edited[2001] = word[1];
+        utf7_init(&ctx, 0);
+        ctx.buf = want;
+        ctx.len = sizeof(want);
+        for (i = 0; i < n; i++)
+            utf7_encode(&ctx, edited[i]);
+        utf7_encode(&ctx, UTF7_FLUSH);
+        wlen = ctx.buf - want;
+
+        utf7_init(&ctx, 0);
+        ctx.buf = out;
+        ctx.len = 4;
+        r = utf7_edit(&ctx, doc, len, &idx, 2000, 2002, word, 2, &sp);
+        k += r != UTF7_FULL || ctx.buf != out;
+        ctx.len = sizeof(out);
+        r = utf7_edit(&ctx, doc, len, &idx, 2000, 2002, word, 2, &sp);
+        k += r != UTF7_OK || sp.tail - sp.head > 8 || sp.length > 16;
+        k += sp.removed != 3 || sp.added != 3;
+        nlen = sp.head + sp.length + (len - sp.tail);
+        memmove(out + sp.head, out, sp.length);
+        memcpy(out, doc, sp.head);
+        memcpy(out + sp.head + sp.length, doc + sp.tail, len - sp.tail);
+        k += nlen != wlen || memcmp(out, want, wlen);
+
+        /* the index follows the edit */
+        utf7_index_splice(&idx, &sp);
+        k += idx.byte != wlen || idx.codepoint != n;
+        for (i = 0; i < idx.count; i++) {
+            utf7_init(&ctx, 0);
+            utf7_index_seek(&ctx, idx.points + i);
+            ctx.buf = want + idx.points[i].byte;
+            ctx.len = wlen - idx.points[i].byte;
+            k += utf7_decode(&ctx) != edited[idx.points[i].codepoint];
+        }
+
+        /* deleting everything, and appending past the end */
+        utf7_init(&ctx, 0);
+        ctx.buf = out;
+        ctx.len = sizeof(out);
+        r = utf7_edit(&ctx, doc, len, 0, 0, n, 0, 0, &sp);
+        k += r != UTF7_OK || sp.head || sp.tail != len || sp.length;
+        utf7_init(&ctx, 0);
+        ctx.buf = out;
+        ctx.len = sizeof(out);
+        r = utf7_edit(&ctx, "a+ZeU-", 6, 0, 9, 9, word, 1, &sp);
+        k += r != UTF7_OK || sp.head != 1 || sp.tail != 6;
+        k += sp.length != 8 || memcmp(out, "+ZeUmOg-", 8);
+        r = utf7_edit(&ctx, "a+ZeU", 5, 0, 9, 9, word, 1, &sp);
+        k += r != UTF7_INCOMPLETE;
+
+        if (k) {
+            printf(C_RED("FAIL") ": %s\n", name);
+            fails++;
+        } else {
+            printf(C_GREEN("PASS") ": %s\n", name);
+        }
+    }
+
     return fails ? EXIT_FAILURE : EXIT_SUCCESS;
 
     return fails ? EXIT_FAILURE : EXIT_SUCCESS;
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "utf8.h"
 
 void
@@ -7,6 +8,37 @@ utf8_init(struct utf8 *ctx)
     *ctx = zero;
 }
 
+#define UTF8_STATE_VERSION 1
+
+/* Blob layout: version, held byte count, then the held bytes. */
+void
+utf8_save_state(const struct utf8 *ctx, unsigned char *blob)
+{
+    int i;
+    blob[0] = UTF8_STATE_VERSION;
+    blob[1] = ctx->n;
+    for (i = 0; i < 4; i++)
+        blob[2 + i] = i < ctx->n ? ctx->hold[i] : 0;
+}
+
+int
+utf8_load_state(struct utf8 *ctx, const unsigned char *blob)
+{
+    int i;
+    if (blob[0] != UTF8_STATE_VERSION || blob[1] > 4)
+        return UTF8_INVALID;
+    ctx->n = blob[1];
+    for (i = 0; i < 4; i++)
+        ctx->hold[i] = blob[2 + i];
+    return UTF8_OK;
+}
+
+static int
+utf8_size(long c)
+{
+    return 1 + (c >= (1L << 7)) + (c >= (1L << 11)) + (c >= (1L << 16));
+}
+
 static void *
 utf8_encode_1(void *buf, long c)
 {
@@ -32,36 +64,55 @@ utf8_encode_1(void *buf, long c)
     }
 }
 
-static void *
-utf8_decode_1(void *buf, long *c)
+/* Decode and validate one sequence from at most len bytes.
+ * Returns the length of the sequence, 0 if len is too short to tell,
+ * or -1 if the sequence is invalid. Overlong forms, surrogate halves,
+ * and code points beyond U+10FFFF are all rejected.
+ */
+static int
+utf8_decode_1(const void *buf, size_t len, long *c)
 {
-    unsigned char *s = buf;
-    unsigned char *next;
-    if (s[0] < 0x80) {
+    const unsigned char *s = buf;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xbf;
+    size_t n, i;
+
+    if (!len) {
+        return 0;
+    } else if (s[0] < 0x80) {
         *c = s[0];
-        next = s + 1;
-    } else if ((s[0] & 0xe0) == 0xc0) {
-        *c = ((long)(s[0] & 0x1f) <<  6) |
-             ((long)(s[1] & 0x3f) <<  0);
-        next = s + 2;
-    } else if ((s[0] & 0xf0) == 0xe0) {
-        *c = ((long)(s[0] & 0x0f) << 12) |
-             ((long)(s[1] & 0x3f) <<  6) |
-             ((long)(s[2] & 0x3f) <<  0);
-        next = s + 3;
-    } else if ((s[0] & 0xf8) == 0xf0 && (s[0] <= 0xf4)) {
-        *c = ((long)(s[0] & 0x07) << 18) |
-             ((long)(s[1] & 0x3f) << 12) |
-             ((long)(s[2] & 0x3f) <<  6) |
-             ((long)(s[3] & 0x3f) <<  0);
-        next = s + 4;
+        return 1;
+    } else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        *c = s[0] & 0x1f;
+        n = 2;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        *c = s[0] & 0x0f;
+        n = 3;
+        if (s[0] == 0xe0)
+            lo = 0xa0; /* overlong */
+        else if (s[0] == 0xed)
+            hi = 0x9f; /* surrogate half */
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        *c = s[0] & 0x07;
+        n = 4;
+        if (s[0] == 0xf0)
+            lo = 0x90; /* overlong */
+        else if (s[0] == 0xf4)
+            hi = 0x8f; /* beyond U+10FFFF */
     } else {
-        *c = -1; /* invalid */
-        next = s;
+        return -1;
     }
-    if (*c >= 0xd800 && *c <= 0xdfff)
-        *c = -1; /* surrogate half */
-    return next;
+
+    for (i = 1; i < n; i++) {
+        if (i == len)
+            return 0;
+        if (s[i] < lo || s[i] > hi)
+            return -1;
+        *c = (*c << 6) | (s[i] & 0x3f);
+        lo = 0x80;
+        hi = 0xbf;
+    }
+    return n;
 }
 
 static int
@@ -90,7 +141,7 @@ utf8_partial(struct utf8 *ctx)
 int
 utf8_encode(struct utf8 *ctx, long c)
 {
-    if (utf8_partial(ctx) != UTF8_OK) {
+    if (ctx->n && utf8_partial(ctx) != UTF8_OK) {
         /* didn't finish flushing last code point */
         return UTF8_FULL;
 
@@ -98,8 +149,8 @@ utf8_encode(struct utf8 *ctx, long c)
         /* flush */
         return UTF8_OK;
 
-    } else if (ctx->len < 4) {
-        /* may not be enough space in output, write to temporary */
+    } else if (ctx->len < (size_t)utf8_size(c)) {
+        /* not enough space in output, write to temporary */
         ctx->n = (char *)utf8_encode_1(ctx->hold, c) - ctx->hold;
         utf8_partial(ctx);
         return UTF8_OK; /* successfully consumed code point */
@@ -113,68 +164,176 @@ utf8_encode(struct utf8 *ctx, long c)
     }
 }
 
+size_t
+utf8_encode_block(struct utf8 *ctx, const long *in, size_t n)
+{
+    size_t i = 0;
+    unsigned char *p, *end;
+
+    if (ctx->n && utf8_partial(ctx) != UTF8_OK)
+        return 0;
+
+    p = (unsigned char *)ctx->buf;
+    end = p + ctx->len;
+    for (;;) {
+        /* these code points are certain to fit: no capacity checks */
+        size_t k = (size_t)(end - p) / 4;
+        if (k > n - i)
+            k = n - i;
+        if (!k)
+            break;
+        k += i;
+        for (; i + 4 <= k; i += 4) {
+            if ((in[i] | in[i + 1] | in[i + 2] | in[i + 3]) < 0x80) {
+                p[0] = in[i + 0];
+                p[1] = in[i + 1];
+                p[2] = in[i + 2];
+                p[3] = in[i + 3];
+                p += 4;
+            } else if ((in[i] | in[i + 1] | in[i + 2] | in[i + 3]) < 0x800) {
+                /* a run of 1- and 2-byte code points */
+                int j;
+                for (j = 0; j < 4; j++) {
+                    long c = in[i + j];
+                    if (c < 0x80) {
+                        *p++ = c;
+                    } else {
+                        p[0] = 0xc0 | (c >> 6);
+                        p[1] = 0x80 | (c & 0x3f);
+                        p += 2;
+                    }
+                }
+            } else {
+                p = utf8_encode_1(p, in[i + 0]);
+                p = utf8_encode_1(p, in[i + 1]);
+                p = utf8_encode_1(p, in[i + 2]);
+                p = utf8_encode_1(p, in[i + 3]);
+            }
+        }
+        for (; i < k; i++)
+            p = utf8_encode_1(p, in[i]);
+    }
+
+    /* the last few bytes of the buffer: check each code point */
+    for (; i < n && end - p >= utf8_size(in[i]); i++)
+        p = utf8_encode_1(p, in[i]);
+
+    ctx->len -= (char *)p - ctx->buf;
+    ctx->buf = (char *)p;
+    return i;
+}
+
 long
 utf8_decode(struct utf8 *ctx)
 {
-    long c;          /* the character that was read */
-    char *p;         /* position of next character */
-    char *buf;       /* source buffer for code point */
-    int len;         /* length of source buffer */
-    int adjust = 0;  /* extra adjustment for updating the context */
-
-    /* Nothing left to read */
-    if (!ctx->n && !ctx->len)
-        return UTF8_OK;
+    long c;
+    int r;
 
     if (ctx->n) {
-        /* continue from previous read */
-        int clen = (char *)utf8_decode_1(ctx->hold, &c) - ctx->hold;
-
-        if (ctx->len + ctx->n < (size_t)clen) {
-            /* still not enough data */
-            int i;
-            for (i = 0; i < (int)ctx->len; i++)
-                ctx->hold[ctx->n + i] = ctx->buf[i];
-            ctx->n += ctx->len;
-            ctx->buf += ctx->len;
-            ctx->len -= ctx->len;
-            return UTF8_INCOMPLETE;
-
-        } else {
-            /* copy the rest of this character */
-            int i;
-            for (i = 0; i < clen - ctx->n; i++)
-                ctx->hold[ctx->n + i] = ctx->buf[i];
-            adjust = ctx->n;
-            buf = ctx->hold;
-            len = clen;
+        /* continue a sequence split across buffers */
+        for (;;) {
+            r = utf8_decode_1(ctx->hold, ctx->n, &c);
+            if (r > 0) {
+                ctx->n = 0;
+                return c;
+            } else if (r < 0) {
+                ctx->n = 0;
+                return UTF8_INVALID;
+            } else if (!ctx->len) {
+                return UTF8_INCOMPLETE;
+            }
+            ctx->hold[ctx->n++] = *ctx->buf++;
+            ctx->len--;
         }
     }
 
-    else if (ctx->len < sizeof(ctx->hold)) {
-        /* buffer might be incomplete */
-        for (ctx->n = 0; ctx->n < (int)ctx->len; ctx->n++)
-            ctx->hold[ctx->n] = ctx->buf[ctx->n];
-        buf = ctx->hold;
-        len = ctx->len;
-    } else {
-        buf = ctx->buf;
-        len = 4;
+    r = utf8_decode_1(ctx->buf, ctx->len, &c);
+    if (r < 0) {
+        /* leave buf pointing at the offending sequence */
+        return UTF8_INVALID;
+    } else if (!r) {
+        /* hold on to a sequence split across buffers */
+        if (!ctx->len)
+            return UTF8_OK;
+        while (ctx->len) {
+            ctx->hold[ctx->n++] = *ctx->buf++;
+            ctx->len--;
+        }
+        return UTF8_INCOMPLETE;
     }
+    ctx->buf += r;
+    ctx->len -= r;
+    return c;
+}
 
-    /* decode from the selected buffer */
-    p = utf8_decode_1(buf, &c);
-    if (p - buf > len) {
-        /* not enough bytes in the buffer */
-        ctx->buf += ctx->len;
-        ctx->len = 0;
-        return UTF8_INCOMPLETE;
+size_t
+utf8_decode_block(struct utf8 *ctx, long *out, size_t n)
+{
+    size_t i = 0;
+    const unsigned char *s;
+    unsigned long high = (unsigned long)-1 / 0xff * 0x80;
+
+    if (ctx->n)
+        return 0; /* left for utf8_decode() */
+
+    s = (unsigned char *)ctx->buf;
+    while (i < n) {
+        size_t avail = ctx->len - (s - (unsigned char *)ctx->buf);
+        long c;
+        int r;
+
+        /* widen whole words of ASCII at once */
+        if (avail >= sizeof(high) && n - i >= sizeof(high)) {
+            unsigned long w;
+            memcpy(&w, s, sizeof(w));
+            if (!(w & high)) {
+                size_t j;
+                for (j = 0; j < sizeof(high); j++)
+                    out[i + j] = s[j];
+                i += sizeof(high);
+                s += sizeof(high);
+                continue;
+            }
+        }
+
+        r = utf8_decode_1(s, avail, &c);
+        if (r <= 0)
+            break; /* left for utf8_decode() */
+        out[i++] = c;
+        s += r;
     }
-    ctx->n = 0;
-    ctx->buf += p - buf - adjust;
-    ctx->len -= p - buf - adjust;
 
-    if (c < 0)
-        return UTF8_INVALID;
-    return c;
+    ctx->len -= (char *)s - ctx->buf;
+    ctx->buf = (char *)s;
+    return i;
+}
+
+/* Length of the leading run of ASCII bytes, a word at a time. */
+static size_t
+utf8_ascii(const char *s, size_t len)
+{
+    size_t i = 0;
+    unsigned long high = (unsigned long)-1 / 0xff * 0x80;
+    for (; len - i >= sizeof(high); i += sizeof(high)) {
+        unsigned long w;
+        memcpy(&w, s + i, sizeof(w));
+        if (w & high)
+            break;
+    }
+    for (; i < len; i++)
+        if ((unsigned char)s[i] > 0x7f)
+            break;
+    return i;
+}
+
+size_t
+utf8_encode_span(const struct utf8 *ctx, const char *s, size_t len)
+{
+    return ctx->n ? 0 : utf8_ascii(s, len);
+}
+
+size_t
+utf8_decode_span(const struct utf8 *ctx, const char *s, size_t len)
+{
+    return ctx->n ? 0 : utf8_ascii(s, len);
 }
@@ -26,4 +26,28 @@ void utf8_init(struct utf8 *ctx);
 int  utf8_encode(struct utf8 *ctx, long c);
 long utf8_decode(struct utf8 *ctx);
 
+/* Encode up to n code points from in and return the number consumed.
+ * Stops early when the next code point doesn't fit in the output, which
+ * is never split across buffers. Output held over from utf8_encode() is
+ * written out first; if that doesn't fit, nothing is consumed.
+ */
+size_t utf8_encode_block(struct utf8 *ctx, const long *in, size_t n);
+
+/* Decode up to n code points into out and return the number decoded.
+ * Stops early at the end of input, at a sequence split across buffers,
+ * or at invalid input. Call utf8_decode() to find out which and to
+ * continue from there.
+ */
+size_t utf8_decode_block(struct utf8 *ctx, long *out, size_t n);
+
+/* Save the state held between calls to a UTF8_STATE_SIZE byte blob,
+ * and restore it. Loading returns UTF8_INVALID for a foreign blob.
+ */
+#define UTF8_STATE_SIZE  6
+void utf8_save_state(const struct utf8 *ctx, unsigned char *blob);
+int  utf8_load_state(struct utf8 *ctx, const unsigned char *blob);
+
+size_t utf8_encode_span(const struct utf8 *ctx, const char *s, size_t len);
+size_t utf8_decode_span(const struct utf8 *ctx, const char *s, size_t len);
+
 #endif
@@ -10,6 +10,12 @@
 #define UTF7_F_OPEN  (1U << 0)  /* a shifted encoding is open */
 #define UTF7_F_USED  (1U << 1)  /* something has been encoded */
 
+#ifdef UTF7_STATS
+#  define UTF7_COUNT(ctx, counter) ((ctx)->stats.counter++)
+#else
+#  define UTF7_COUNT(ctx, counter) ((void)0)
+#endif
+
 static int
 utf7_isdirect(const struct utf7 *ctx, long c)
 {
@@ -21,18 +27,105 @@ utf7_init(struct utf7 *ctx, const char *indirect)
 {
     struct utf7 zero = {
         0, 0, 0, 0, 0, 0,
-        {0x2600, 0x0000, 0xF7FF, 0xFFFF, 0xFFFF, 0xEFFF, 0xFFFF, 0x3FFF}
+        {0, 0, 0, 0, 0, 0, 0, 0},
+        0
+#ifdef UTF7_STATS
+        , {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+#endif
     };
+    struct utf7_set set;
+    int i;
     *ctx = zero;
+    utf7_set_init(&set, indirect);
+    for (i = 0; i < 8; i++)
+        ctx->direct[i] = set.direct[i];
+}
+
+void
+utf7_set_init(struct utf7_set *set, const char *indirect)
+{
+    static const unsigned short direct[8] = {
+        0x2600, 0x0000, 0xF7FF, 0xFFFF, 0xFFFF, 0xEFFF, 0xFFFF, 0x3FFF
+    };
+    int i;
+    for (i = 0; i < 8; i++)
+        set->direct[i] = direct[i];
     if (indirect) {
         for (; *indirect; indirect++) {
             int c = *indirect;
             if (c < 128)
-                ctx->direct[c / 16] &= ~(1U << (c % 16));
+                set->direct[c / 16] &= ~(1U << (c % 16));
         }
     }
 }
 
+/* The encoder may leave up to 31 bits pending when a surrogate pair
+ * meets a full buffer, so the whole 32-bit accumulator is kept.
+ */
+void
+utf7_load(struct utf7 *ctx, const struct utf7_set *set,
+          const struct utf7_state *state)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        ctx->direct[i] = set->direct[i];
+    ctx->accum = (unsigned long)state->accum[1] << 16 | state->accum[0];
+    ctx->bits = state->info & 0x1f;
+    ctx->flags = (state->info >> 5) & 0x03U;
+    ctx->high = state->high;
+}
+
+void
+utf7_store(const struct utf7 *ctx, struct utf7_state *state)
+{
+    state->accum[0] = ctx->accum & 0xffffUL;
+    state->accum[1] = ctx->accum >> 16 & 0xffffUL;
+    state->info = (unsigned)ctx->bits | ctx->flags << 5;
+    state->high = ctx->high;
+}
+
+#define UTF7_STATE_VERSION 1
+
+/* Blob layout, all big endian:
+ *   0     version
+ *   1     bit count (5 bits) and flags (2 bits)
+ *   2..5  pending bits, the rest zeroed
+ *   6..7  pending high surrogate, or zero
+ */
+void
+utf7_save_state(const struct utf7 *ctx, unsigned char *blob)
+{
+    unsigned long accum = 0;
+    if (ctx->bits)
+        accum = ctx->accum & ((2UL << (ctx->bits - 1)) - 1);
+    blob[0] = UTF7_STATE_VERSION;
+    blob[1] = ctx->bits | ctx->flags << 5;
+    blob[2] = accum >> 24 & 0xff;
+    blob[3] = accum >> 16 & 0xff;
+    blob[4] = accum >>  8 & 0xff;
+    blob[5] = accum >>  0 & 0xff;
+    blob[6] = ctx->high >> 8 & 0xff;
+    blob[7] = ctx->high >> 0 & 0xff;
+}
+
+int
+utf7_load_state(struct utf7 *ctx, const unsigned char *blob)
+{
+    unsigned high = (unsigned)blob[6] << 8 | blob[7];
+    if (blob[0] != UTF7_STATE_VERSION || blob[1] >> 7)
+        return UTF7_INVALID;
+    if (high && (high < 0xd800U || high > 0xdbffU))
+        return UTF7_INVALID;
+    ctx->accum = (unsigned long)blob[2] << 24 |
+                 (unsigned long)blob[3] << 16 |
+                 (unsigned long)blob[4] <<  8 |
+                 (unsigned long)blob[5] <<  0;
+    ctx->bits = blob[1] & 0x1f;
+    ctx->flags = blob[1] >> 5 & 0x03U;
+    ctx->high = high;
+    return UTF7_OK;
+}
+
 static int
 utf7_base64e(int v)
 {
@@ -84,6 +177,7 @@ utf7_partial(struct utf7 *ctx)
         *ctx->buf++ = utf7_base64e(a);
         ctx->len--;
         ctx->bits -= 6;
+        UTF7_COUNT(ctx, base64);
     }
     return UTF7_OK;
 }
@@ -103,6 +197,7 @@ utf7_close(struct utf7 *ctx, int next)
             *ctx->buf++ = utf7_base64e(a);
             ctx->len--;
             ctx->bits = 0;
+            UTF7_COUNT(ctx, base64);
         }
 
         /* Close the encoding */
@@ -111,21 +206,34 @@ utf7_close(struct utf7 *ctx, int next)
                 return UTF7_FULL;
             *ctx->buf++ = 0x2d; /* '-' */
             ctx->len--;
+            UTF7_COUNT(ctx, dashes);
         }
         ctx->flags &= ~UTF7_F_OPEN;
+        UTF7_COUNT(ctx, closed);
     }
     return UTF7_OK;
 }
 
+static int
+utf7_full(struct utf7 *ctx)
+{
+    UTF7_COUNT(ctx, full);
+    (void)ctx;
+    return UTF7_FULL;
+}
+
 int
 utf7_encode(struct utf7 *ctx, long c)
 {
     /* flush crumbs left from last code point */
     if (utf7_partial(ctx) != UTF7_OK)
-        return UTF7_FULL;
+        return utf7_full(ctx);
 
-    if (c == UTF7_FLUSH)
-        return utf7_close(ctx, 0x2d);
+    if (c == UTF7_FLUSH) {
+        if (utf7_close(ctx, 0x2d) != UTF7_OK)
+            return utf7_full(ctx);
+        return UTF7_OK;
+    }
 
     if (!utf7_isdirect(ctx, c)) {
         /* use an indirect encoding */
@@ -133,7 +241,7 @@ utf7_encode(struct utf7 *ctx, long c)
         /* Start encoding if not already */
         if (!(ctx->flags & UTF7_F_OPEN)) {
             if (!ctx->len)
-                return UTF7_FULL;
+                return utf7_full(ctx);
             ctx->flags &= ~UTF7_F_USED;
             ctx->flags |= UTF7_F_OPEN;
             *ctx->buf++ = 0x2b; /* '+' */
@@ -148,9 +256,12 @@ utf7_encode(struct utf7 *ctx, long c)
 
             /* require at least byte to spare */
             if (!ctx->len)
-                return UTF7_FULL;
+                return utf7_full(ctx);
 
             /* codepoint can now be fully consumed */
+            if (!(ctx->flags & UTF7_F_USED))
+                UTF7_COUNT(ctx, opened);
+            UTF7_COUNT(ctx, surrogates);
             ctx->flags |= UTF7_F_USED;
             ctx->accum <<= 16;
             ctx->accum |= xh;
@@ -164,14 +275,17 @@ utf7_encode(struct utf7 *ctx, long c)
         } else if (c == 0x2b && !(ctx->flags & UTF7_F_USED)) {
             /* '+' special case */
             if (!ctx->len)
-                return UTF7_FULL;
+                return utf7_full(ctx);
             *ctx->buf++ = 0x2d; /* '-' */
             ctx->len--;
             ctx->flags &= ~UTF7_F_OPEN;
+            UTF7_COUNT(ctx, escapes);
             return UTF7_OK; /* successfully consumed */
 
         } else {
             /* plain old encoding */
+            if (!(ctx->flags & UTF7_F_USED))
+                UTF7_COUNT(ctx, opened);
             ctx->accum <<= 16;
             ctx->accum |= c;
             ctx->bits += 16;
@@ -184,17 +298,30 @@ utf7_encode(struct utf7 *ctx, long c)
 
         /* close any open encodings first */
         if (utf7_close(ctx, c) != UTF7_OK)
-            return UTF7_FULL;
+            return utf7_full(ctx);
 
         /* direct character write */
         if (!ctx->len)
-            return UTF7_FULL;
+            return utf7_full(ctx);
         *ctx->buf++ = (char)c;
         ctx->len--;
+        UTF7_COUNT(ctx, direct);
         return UTF7_OK;
     }
 }
 
+size_t
+utf7_encode_span(const struct utf7 *ctx, const char *s, size_t len)
+{
+    size_t i;
+    if ((ctx->flags & UTF7_F_OPEN) || ctx->bits)
+        return 0; /* next direct character must close the encoding */
+    for (i = 0; i < len; i++)
+        if (!utf7_isdirect(ctx, (unsigned char)s[i]))
+            break;
+    return i;
+}
+
 static int
 utf7_ishigh(long c)
 {
@@ -207,16 +334,45 @@ utf7_islow(long c)
     return c >= 0xdc00L && c <= 0xdfffL;
 }
 
-long
-utf7_decode(struct utf7 *ctx)
+/* Handle invalid input at buf[-1]. A strict decoder backs up so that
+ * buf points at the offending byte and reports UTF7_INVALID. A lenient
+ * decoder backs up only when asked to keep the byte, records an error
+ * spanning everything consumed by this call, and returns the
+ * replacement code point. The caller must already have resynchronized
+ * the state for lenient decoding.
+ */
+static long
+utf7_invalid(struct utf7 *ctx, int kind, int keep)
+{
+    struct utf7_lenient *l = ctx->lenient;
+
+    if (!l || keep) {
+        ctx->buf--;
+        ctx->len++;
+    }
+    if (!l)
+        return UTF7_INVALID;
+
+    if (l->count < l->cap) {
+        struct utf7_error *e = l->errors + l->count;
+        e->offset = l->offset;
+        e->length = ctx->buf - l->start;
+        e->kind = kind;
+    }
+    l->count++;
+    return l->replacement;
+}
+
+static long
+utf7_decode_1(struct utf7 *ctx)
 {
     while (ctx->len) {
         int c = *ctx->buf++;
         ctx->len--;
         if (c < 0 || c > 127) {
-            ctx->buf--;
-            ctx->len++;
-            return UTF7_INVALID;
+            /* lenient: skip the byte */
+            UTF7_COUNT(ctx, bad_byte);
+            return utf7_invalid(ctx, UTF7_E_BYTE, 0);
         }
 
         if (ctx->flags & UTF7_F_OPEN) {
@@ -226,6 +382,7 @@ utf7_decode(struct utf7 *ctx)
             if (!(ctx->flags & UTF7_F_USED) && c == 0x2d) {
                 /* "+-" encoding for '+' */
                 ctx->flags &= ~UTF7_F_OPEN;
+                UTF7_COUNT(ctx, escapes);
                 return 0x2b;
             }
 
@@ -233,21 +390,18 @@ utf7_decode(struct utf7 *ctx)
             v = utf7_base64d(c);
             if (v < 0) {
                 /* end of encoding */
-                unsigned long mask;
+                unsigned long mask = (1UL << ctx->bits) - 1;
 
-                if (ctx->bits >= 6) {
-                    /* too many bits in accumulation buffer */
-                    ctx->buf--;
-                    ctx->len++;
-                    return UTF7_INVALID;
-                }
-
-                mask = (1UL << ctx->bits) - 1;
-                if (ctx->accum & mask) {
-                    /* non-zero trailing base64 bits */
-                    ctx->buf--;
-                    ctx->len++;
-                    return UTF7_INVALID;
+                if (ctx->bits >= 6 || (ctx->accum & mask)) {
+                    /* too many or non-zero trailing base64 bits */
+                    UTF7_COUNT(ctx, bad_bits);
+                    if (ctx->lenient) {
+                        /* lenient: drop the segment and its '-' */
+                        ctx->flags &= ~UTF7_F_OPEN;
+                        ctx->bits = 0;
+                        ctx->high = 0;
+                    }
+                    return utf7_invalid(ctx, UTF7_E_BITS, c != 0x2d);
                 }
 
                 ctx->flags &= ~UTF7_F_OPEN;
@@ -255,24 +409,30 @@ utf7_decode(struct utf7 *ctx)
                 if (c != 0x2d) {
                     if (ctx->high) {
                         /* unpaired high surrogate */
-                        ctx->buf--;
-                        ctx->len++;
-                        return UTF7_INVALID;
+                        UTF7_COUNT(ctx, bad_pair);
+                        ctx->high = ctx->lenient ? 0 : ctx->high;
+                        return utf7_invalid(ctx, UTF7_E_PAIR, 1);
 
                     } else if (ctx->flags & UTF7_F_USED) {
                         /* valid ending for shift encoding */
+                        UTF7_COUNT(ctx, closed);
+                        UTF7_COUNT(ctx, direct);
                         return c;
 
                     } else {
                         /* shift encoded ended without being used */
-                        ctx->buf--;
-                        ctx->len++;
-                        return UTF7_INVALID;
+                        UTF7_COUNT(ctx, bad_shift);
+                        return utf7_invalid(ctx, UTF7_E_SHIFT, 1);
                     }
                 }
+                UTF7_COUNT(ctx, closed);
+                UTF7_COUNT(ctx, dashes);
 
             } else {
                 /* accumulate more base64 bits */
+                if (!(ctx->flags & UTF7_F_USED))
+                    UTF7_COUNT(ctx, opened);
+                UTF7_COUNT(ctx, base64);
                 ctx->flags |= UTF7_F_USED;
                 ctx->accum = (ctx->accum << 6) | v;
                 ctx->bits += 6;
@@ -285,25 +445,34 @@ utf7_decode(struct utf7 *ctx)
                         /* next code point must be low surrogate */
                         unsigned long h = ctx->high;
                         if (!utf7_islow(c)) {
-                            ctx->buf--;
-                            ctx->len++;
-                            return UTF7_INVALID;
+                            UTF7_COUNT(ctx, bad_pair);
+                            if (!ctx->lenient) {
+                                return utf7_invalid(ctx, UTF7_E_PAIR, 1);
+                            } else if (utf7_ishigh(c)) {
+                                /* lenient: pair up with the next one */
+                                ctx->high = c;
+                            } else {
+                                /* lenient: return this one next */
+                                ctx->high = 0;
+                                ctx->lenient->pending = c;
+                            }
+                            return utf7_invalid(ctx, UTF7_E_PAIR, 0);
                         }
                         ctx->high = 0;
+                        UTF7_COUNT(ctx, surrogates);
                         c = ((h - 0xd800UL) * 0x400UL) +
                             ((c - 0xdc00UL) + 0x10000UL);
 
                     } else if (utf7_ishigh(c)) {
                         /* recurse to look for low surrogate */
                         ctx->high = c;
-                        return utf7_decode(ctx);
+                        return utf7_decode_1(ctx);
                     }
 
                     else if (utf7_islow(c)) {
                         /* unpaired low surrogate */
-                        ctx->buf--;
-                        ctx->len++;
-                        return UTF7_INVALID;
+                        UTF7_COUNT(ctx, bad_pair);
+                        return utf7_invalid(ctx, UTF7_E_PAIR, !ctx->lenient);
                     }
 
                     /* not a surrogate */
@@ -321,17 +490,1593 @@ utf7_decode(struct utf7 *ctx)
             /* direct encoded character */
             if (ctx->high) {
                 /* there was an unpaired high surrogate */
-                ctx->buf--;
-                ctx->len++;
-                return UTF7_INVALID;
+                UTF7_COUNT(ctx, bad_pair);
+                ctx->high = ctx->lenient ? 0 : ctx->high;
+                return utf7_invalid(ctx, UTF7_E_PAIR, 1);
             }
+            UTF7_COUNT(ctx, direct);
             return c;
         }
     }
 
-    if (ctx->flags & UTF7_F_OPEN)
-        return UTF7_INCOMPLETE;
-    if (ctx->high)
+    if ((ctx->flags & UTF7_F_OPEN) || ctx->high) {
+        UTF7_COUNT(ctx, incomplete);
         return UTF7_INCOMPLETE;
+    }
+    return UTF7_OK;
+}
+
+long
+utf7_decode(struct utf7 *ctx)
+{
+    struct utf7_lenient *l = ctx->lenient;
+    long c;
+
+    if (!l)
+        return utf7_decode_1(ctx);
+
+    if (l->pending >= 0) {
+        c = l->pending;
+        l->pending = -1;
+        return c;
+    }
+    l->start = ctx->buf;
+    c = utf7_decode_1(ctx);
+    l->offset += ctx->buf - l->start;
+    return c;
+}
+
+void
+utf7_lenient(struct utf7 *ctx, struct utf7_lenient *l, long replacement,
+             struct utf7_error *errors, size_t cap)
+{
+    l->replacement = replacement;
+    l->errors = errors;
+    l->cap = cap;
+    l->count = 0;
+    l->offset = 0;
+    l->start = 0;
+    l->pending = -1;
+    ctx->lenient = l;
+}
+
+size_t
+utf7_decode_span(const struct utf7 *ctx, const char *s, size_t len)
+{
+    size_t i;
+    if ((ctx->flags & UTF7_F_OPEN) || ctx->high)
+        return 0; /* next character is not a plain direct character */
+    if (ctx->lenient && ctx->lenient->pending >= 0)
+        return 0; /* a decoded code point is waiting */
+    for (i = 0; i < len; i++) {
+        int c = (unsigned char)s[i];
+        if (c > 127 || c == 0x2b)
+            break;
+    }
+    return i;
+}
+
+/* ISO-8859-1 bytes are their own code points, so they're encoded
+ * without going through utf7_encode() one at a time: runs of direct
+ * bytes are copied, and runs of the rest are packed as UTF-16 units
+ * straight into the open shifted segment.
+ */
+size_t
+utf7_encode_latin1(struct utf7 *ctx, const char *s, size_t len)
+{
+    const unsigned open = UTF7_F_OPEN | UTF7_F_USED;
+    size_t i = 0;
+
+    while (i < len) {
+        int c = (unsigned char)s[i];
+
+        if (!(ctx->flags & UTF7_F_OPEN) && !ctx->bits) {
+            /* copy a run of direct bytes */
+            size_t j, n = len - i < ctx->len ? len - i : ctx->len;
+            for (j = 0; j < n; j++) {
+                c = (unsigned char)s[i + j];
+                if (!utf7_isdirect(ctx, c))
+                    break;
+                ctx->buf[j] = (char)c;
+            }
+            ctx->buf += j;
+            ctx->len -= j;
+            i += j;
+#ifdef UTF7_STATS
+            ctx->stats.direct += j;
+#endif
+            if (i == len)
+                break;
+        }
+
+        if ((ctx->flags & open) == open && ctx->len >= UTF7_MAX_ENCODE &&
+            !utf7_isdirect(ctx, c)) {
+            /* pack a run of indirect bytes, with room for each */
+            do {
+                utf7_partial(ctx);
+                ctx->accum = ctx->accum << 16 | (unsigned long)c;
+                ctx->bits += 16;
+                if (++i == len)
+                    break;
+                c = (unsigned char)s[i];
+            } while (ctx->len >= UTF7_MAX_ENCODE && !utf7_isdirect(ctx, c));
+            continue;
+        }
+
+        /* opening and closing segments, and full buffers */
+        if (utf7_encode(ctx, c) != UTF7_OK)
+            break;
+        i++;
+    }
+    return i;
+}
+
+long
+utf7_decode_latin1(struct utf7 *ctx, char *out, size_t *len)
+{
+    size_t i, n = 0;
+    long c;
+
+    for (;;) {
+        size_t k = ctx->len < *len - n ? ctx->len : *len - n;
+        k = utf7_decode_span(ctx, ctx->buf, k);
+        for (i = 0; i < k; i++)
+            out[n + i] = ctx->buf[i];
+        n += k;
+        ctx->buf += k;
+        ctx->len -= k;
+        if (ctx->lenient)
+            ctx->lenient->offset += k;
+#ifdef UTF7_STATS
+        ctx->stats.direct += k;
+#endif
+
+        if (n == *len) {
+            c = UTF7_FULL;
+            break;
+        }
+        c = utf7_decode(ctx);
+        if (c < 0 || c > 0xff)
+            break;
+        out[n++] = (char)c;
+    }
+    *len = n;
+    return c;
+}
+
+int
+utf7_stats(const struct utf7 *ctx, struct utf7_stats *stats)
+{
+#ifdef UTF7_STATS
+    *stats = ctx->stats;
+    return 1;
+#else
+    struct utf7_stats zero = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    (void)ctx;
+    *stats = zero;
+    return 0;
+#endif
+}
+
+/* Clear the shift state, keeping the direct set. */
+static void
+utf7_reset(struct utf7 *ctx)
+{
+    ctx->accum = 0;
+    ctx->bits = 0;
+    ctx->flags = 0;
+    ctx->high = 0;
+}
+
+int
+utf7_encode_batch(const struct utf7 *proto, const long *in,
+                  const size_t *in_off, size_t count,
+                  char *out, size_t cap, size_t *out_off, size_t *done)
+{
+    size_t i;
+    struct utf7 ctx = *proto;
+
+    ctx.lenient = 0;
+    out_off[0] = 0;
+    for (i = 0; i < count; i++) {
+        size_t j = in_off[i];
+        size_t end = in_off[i + 1];
+
+        utf7_reset(&ctx);
+        ctx.buf = out + out_off[i];
+        ctx.len = cap - out_off[i];
+
+        /* Direct text leaves the state untouched, so copy it in a
+         * tight loop and only start the encoder where it ends.
+         */
+        for (; j < end && ctx.len && utf7_isdirect(&ctx, in[j]); j++) {
+            *ctx.buf++ = (char)in[j];
+            ctx.len--;
+        }
+        for (; j <= end; j++) {
+            if (utf7_encode(&ctx, j < end ? in[j] : UTF7_FLUSH) != UTF7_OK) {
+                *done = i;
+                return UTF7_FULL;
+            }
+        }
+        out_off[i + 1] = ctx.buf - out;
+    }
+    *done = count;
+    return UTF7_OK;
+}
+
+int
+utf7_decode_batch(const char *in, const size_t *in_off, size_t count,
+                  long *out, size_t cap, size_t *out_off, size_t *done)
+{
+    size_t i;
+    struct utf7 ctx;
+
+    utf7_init(&ctx, 0);
+    out_off[0] = 0;
+    for (i = 0; i < count; i++) {
+        size_t o = out_off[i];
+        size_t n, k;
+        long c;
+
+        utf7_reset(&ctx);
+        ctx.buf = (char *)in + in_off[i];
+        ctx.len = in_off[i + 1] - in_off[i];
+
+        /* widen the leading direct text */
+        n = utf7_decode_span(&ctx, ctx.buf, ctx.len);
+        if (n > cap - o) {
+            *done = i;
+            return UTF7_FULL;
+        }
+        for (k = 0; k < n; k++)
+            out[o++] = (unsigned char)ctx.buf[k];
+        ctx.buf += n;
+        ctx.len -= n;
+
+        while ((c = utf7_decode(&ctx)) >= 0) {
+            if (o == cap) {
+                *done = i;
+                return UTF7_FULL;
+            }
+            out[o++] = c;
+        }
+        if (c != UTF7_OK) {
+            *done = i;
+            return (int)c;
+        }
+        out_off[i + 1] = o;
+    }
+    *done = count;
+    return UTF7_OK;
+}
+
+void
+utf7_index_init(struct utf7_index *idx, struct utf7_checkpoint *points,
+                size_t cap, unsigned long interval)
+{
+    idx->points = points;
+    idx->cap = cap;
+    idx->count = 0;
+    idx->interval = interval ? interval : 1;
+    idx->byte = 0;
+    idx->codepoint = 0;
+    idx->next = 0;
+    utf7_init(&idx->ctx, 0);
+}
+
+/* Record a checkpoint at the given offset, thinning the index first if
+ * it's full.
+ */
+static void
+utf7_index_mark(struct utf7_index *idx, unsigned long byte)
+{
+    struct utf7_checkpoint *p;
+
+    if (idx->count == idx->cap) {
+        size_t i;
+        for (i = 0; i * 2 < idx->count; i++)
+            idx->points[i] = idx->points[i * 2];
+        idx->count = i;
+        idx->interval *= 2;
+    }
+
+    if (idx->count < idx->cap) {
+        p = idx->points + idx->count++;
+        p->byte = byte;
+        p->codepoint = idx->codepoint;
+        utf7_save_state(&idx->ctx, p->state);
+    }
+    idx->next = byte + idx->interval;
+}
+
+long
+utf7_index_feed(struct utf7_index *idx, const char *buf, size_t len)
+{
+    struct utf7 *ctx = &idx->ctx;
+    unsigned long base = idx->byte;
+    long c;
+
+    ctx->buf = (char *)buf;
+    ctx->len = len;
+    for (;;) {
+        unsigned long at = base + (ctx->buf - buf);
+        size_t n;
+
+        if (at >= idx->next)
+            utf7_index_mark(idx, at);
+
+        /* Skip direct text, stopping at the next checkpoint. */
+        n = utf7_decode_span(ctx, ctx->buf, ctx->len);
+        if (n > idx->next - at)
+            n = idx->next - at;
+        if (n) {
+            ctx->buf += n;
+            ctx->len -= n;
+            idx->codepoint += n;
+            continue;
+        }
+
+        c = utf7_decode(ctx);
+        if (c < 0)
+            break;
+        idx->codepoint++;
+    }
+
+    idx->byte = base + (ctx->buf - buf);
+    return c;
+}
+
+const struct utf7_checkpoint *
+utf7_index_find(const struct utf7_index *idx, unsigned long codepoint)
+{
+    size_t lo = 0;
+    size_t hi = idx->count;
+
+    /* the last checkpoint at or before the code point */
+    if (!hi || idx->points[0].codepoint > codepoint)
+        return 0;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->points[mid].codepoint <= codepoint)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return idx->points + lo;
+}
+
+int
+utf7_index_seek(struct utf7 *ctx, const struct utf7_checkpoint *p)
+{
+    return utf7_load_state(ctx, p->state);
+}
+
+/* Serialized index layout, all big endian:
+ *   0..3    magic "U7IX"
+ *   4       version
+ *   5..7    zero
+ *   8..15   interval
+ *   16..23  checkpoint count
+ *   24..31  bytes indexed
+ *   32..39  code points indexed
+ *   40..47  offset of the next checkpoint
+ *   48..55  decoder state
+ * followed by each checkpoint:
+ *   0..7    byte offset
+ *   8..15   code point offset
+ *   16..23  saved state
+ */
+#define UTF7_INDEX_VERSION 2
+#define UTF7_INDEX_HEADER  (48 + UTF7_STATE_SIZE)
+#define UTF7_INDEX_ENTRY   (16 + UTF7_STATE_SIZE)
+
+static void
+utf7_put64(unsigned char *p, unsigned long x)
+{
+    int i;
+    for (i = 7; i >= 0; i--) {
+        p[i] = x & 0xff;
+        x = x >> 4 >> 4;  /* may be only 32 bits wide */
+    }
+}
+
+static unsigned long
+utf7_get64(const unsigned char *p, int *overflow)
+{
+    int i;
+    unsigned long x = 0;
+    for (i = 0; i < 8; i++) {
+        unsigned long y = x << 4 << 4 | p[i];
+        if (y >> 4 >> 4 != x)
+            *overflow = 1;
+        x = y;
+    }
+    return x;
+}
+
+size_t
+utf7_index_save(const struct utf7_index *idx, unsigned char *buf,
+                size_t len)
+{
+    static const unsigned char magic[] = {0x55, 0x37, 0x49, 0x58};
+    size_t need = UTF7_INDEX_HEADER + idx->count * UTF7_INDEX_ENTRY;
+    size_t i;
+    int j;
+
+    if (len < need)
+        return need;
+    for (j = 0; j < 4; j++)
+        buf[j] = magic[j];
+    buf[4] = UTF7_INDEX_VERSION;
+    buf[5] = buf[6] = buf[7] = 0;
+    utf7_put64(buf + 8, idx->interval);
+    utf7_put64(buf + 16, idx->count);
+    utf7_put64(buf + 24, idx->byte);
+    utf7_put64(buf + 32, idx->codepoint);
+    utf7_put64(buf + 40, idx->next);
+    utf7_save_state(&idx->ctx, buf + 48);
+    buf += UTF7_INDEX_HEADER;
+    for (i = 0; i < idx->count; i++) {
+        const struct utf7_checkpoint *p = idx->points + i;
+        utf7_put64(buf, p->byte);
+        utf7_put64(buf + 8, p->codepoint);
+        for (j = 0; j < UTF7_STATE_SIZE; j++)
+            buf[16 + j] = p->state[j];
+        buf += UTF7_INDEX_ENTRY;
+    }
+    return need;
+}
+
+int
+utf7_index_load(struct utf7_index *idx, struct utf7_checkpoint *points,
+                size_t cap, const unsigned char *buf, size_t len)
+{
+    static const unsigned char magic[] = {0x55, 0x37, 0x49, 0x58};
+    unsigned long interval, count;
+    int overflow = 0;
+    size_t i;
+    int j;
+
+    if (len < UTF7_INDEX_HEADER)
+        return UTF7_INVALID;
+    for (j = 0; j < 4; j++)
+        if (buf[j] != magic[j])
+            return UTF7_INVALID;
+    if (buf[4] != UTF7_INDEX_VERSION)
+        return UTF7_INVALID;
+    interval = utf7_get64(buf + 8, &overflow);
+    count = utf7_get64(buf + 16, &overflow);
+    if (overflow || (len - UTF7_INDEX_HEADER) / UTF7_INDEX_ENTRY < count)
+        return UTF7_INVALID;
+    if (count > cap)
+        return UTF7_FULL;
+
+    utf7_index_init(idx, points, cap, interval);
+    idx->byte = utf7_get64(buf + 24, &overflow);
+    idx->codepoint = utf7_get64(buf + 32, &overflow);
+    idx->next = utf7_get64(buf + 40, &overflow);
+    if (utf7_load_state(&idx->ctx, buf + 48) != UTF7_OK)
+        return UTF7_INVALID;
+    buf += UTF7_INDEX_HEADER;
+    for (i = 0; i < count; i++) {
+        struct utf7_checkpoint *p = points + i;
+        p->byte = utf7_get64(buf, &overflow);
+        p->codepoint = utf7_get64(buf + 8, &overflow);
+        for (j = 0; j < UTF7_STATE_SIZE; j++)
+            p->state[j] = buf[16 + j];
+        buf += UTF7_INDEX_ENTRY;
+    }
+    if (overflow)
+        return UTF7_INVALID;
+    idx->count = count;
+    return UTF7_OK;
+}
+
+void
+utf7_search_init(struct utf7_search *s, const long *pattern, size_t len,
+                 size_t *table)
+{
+    size_t i, k = 0;
+    long c;
+    int r;
+
+    s->pattern = pattern;
+    s->len = len;
+    s->table = table;
+
+    /* Knuth-Morris-Pratt failure table in the first half */
+    if (len)
+        table[0] = 0;
+    for (i = 1; i < len; i++) {
+        while (k && pattern[i] != pattern[k])
+            k = table[k - 1];
+        if (pattern[i] == pattern[k])
+            k++;
+        table[i] = k;
+    }
+
+    /* Any match begins with the first code point either as a direct
+     * byte or in base64. A 16-bit unit begins 0, 4, or 2 bits into a
+     * base64 character, and in each case fully determines the next two
+     * characters after those leading bits.
+     */
+    c = len ? pattern[0] : 0;
+    s->first = c < 0x80 && c != 0x2b ? (int)c : -1;
+    if (c >= 0x10000L)
+        c = 0xd800L + ((c - 0x10000L) >> 10);
+    for (r = 0; r < 3; r++) {
+        int lead = r * 4 % 6;
+        s->forms[r][0] = utf7_base64e((c >> (10 - lead)) & 0x3f);
+        s->forms[r][1] = utf7_base64e((c >> (4 - lead)) & 0x3f);
+    }
+}
+
+/* Could a base64 segment contain the pattern's first code point? */
+static int
+utf7_search_forms(const struct utf7_search *s, const unsigned char *p,
+                  size_t len)
+{
+    size_t i;
+    int r;
+    for (i = 1; i < len; i++)
+        for (r = 0; r < 3; r++)
+            if (p[i - 1] == (unsigned char)s->forms[r][0] &&
+                p[i] == (unsigned char)s->forms[r][1])
+                return 1;
+    return 0;
+}
+
+/* Advance the matcher over code point number n, which begins at byte
+ * offset at. Returns 1 on a match that doesn't begin before from.
+ */
+static int
+utf7_search_step(const struct utf7_search *s, size_t *k, long c,
+                 unsigned long n, size_t at, unsigned long from,
+                 struct utf7_match *m)
+{
+    size_t *ring = s->table + s->len;
+    ring[n % s->len] = at;
+    while (*k && s->pattern[*k] != c)
+        *k = s->table[*k - 1];
+    if (s->pattern[*k] == c)
+        (*k)++;
+    if (*k == s->len) {
+        unsigned long start = n + 1 - s->len;
+        if (start >= from) {
+            m->byte = ring[start % s->len];
+            m->codepoint = start;
+            return 1;
+        }
+        *k = s->table[*k - 1];
+    }
+    return 0;
+}
+
+int
+utf7_search(const struct utf7_search *s, const char *buf, size_t len,
+            unsigned long from, struct utf7_match *m)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t i = 0;
+    size_t k = 0;               /* matched pattern length */
+    unsigned long n = 0;        /* code points so far */
+    unsigned long high = 0;     /* pending high surrogate */
+    size_t hbyte = 0;           /* and where it began */
+    int status = 0;
+
+    if (!s->len) {
+        m->byte = 0;
+        m->codepoint = 0;
+        return 1;
+    }
+
+    /* This follows utf7_decode() exactly, including its errors, but
+     * runs the matcher only where a match could be in progress.
+     */
+    while (i < len) {
+        int c = p[i];
+
+        if (c > 127) {
+            status = UTF7_INVALID;
+            break;
+
+        } else if (c != 0x2b) {
+            /* direct text */
+            if (high) {
+                status = UTF7_INVALID;
+                break;
+            }
+            if (!k) {
+                size_t j = i;
+                while (j < len && p[j] != s->first &&
+                       p[j] != 0x2b && p[j] < 0x80)
+                    j++;
+                n += j - i;
+                i = j;
+                if (i == len || p[i] != s->first)
+                    continue;
+            }
+            if (utf7_search_step(s, &k, p[i], n++, i, from, m))
+                return 1;
+            i++;
+
+        } else if (i + 1 < len && p[i + 1] == 0x2d) {
+            /* "+-" encoding for '+' */
+            if (utf7_search_step(s, &k, 0x2b, n++, i, from, m))
+                return 1;
+            i += 2;
+
+        } else {
+            /* a base64 segment */
+            size_t start = i + 1;
+            size_t end = start;
+            size_t at = start;
+            unsigned long accum = 0;
+            unsigned long mask;
+            int bits = 0;
+            int feed;
+
+            while (end < len && utf7_base64d(p[end]) >= 0)
+                end++;
+            feed = k || utf7_search_forms(s, p + start, end - start);
+
+            for (i = start; i < end; i++) {
+                long u;
+                size_t ubyte = at;
+                accum = (accum << 6) | utf7_base64d(p[i]);
+                bits += 6;
+                if (bits < 16)
+                    continue;
+                bits -= 16;
+                at = bits ? i : i + 1;
+                u = (accum >> bits) & 0xffff;
+
+                if (high) {
+                    if (!utf7_islow(u)) {
+                        status = UTF7_INVALID;
+                        break;
+                    }
+                    u = ((high - 0xd800UL) * 0x400UL) +
+                        ((u - 0xdc00UL) + 0x10000UL);
+                    ubyte = hbyte;
+                    high = 0;
+                } else if (utf7_ishigh(u)) {
+                    high = u;
+                    hbyte = ubyte;
+                    continue;
+                } else if (utf7_islow(u)) {
+                    status = UTF7_INVALID;
+                    break;
+                }
+
+                if (!feed)
+                    n++;
+                else if (utf7_search_step(s, &k, u, n++, ubyte, from, m))
+                    return 1;
+            }
+            if (status)
+                break;
+
+            /* the segment must end cleanly */
+            if (end == len) {
+                status = UTF7_INCOMPLETE;
+                break;
+            }
+            mask = (1UL << bits) - 1;
+            if (p[end] > 127 || bits >= 6 || (accum & mask)) {
+                status = UTF7_INVALID;
+                break;
+            }
+            if (p[end] != 0x2d && (high || end == start)) {
+                status = UTF7_INVALID;
+                break;
+            }
+            i = p[end] == 0x2d ? end + 1 : end;
+        }
+    }
+
+    if (!status && high)
+        status = UTF7_INCOMPLETE;
+    m->byte = i;
+    m->codepoint = n;
+    return status;
+}
+
+/* Stop sniffing once this many segments agree and none disagree. */
+#define UTF7_SNIFF_ENOUGH 16
+
+/* Could a UTF-7 encoder have put this code point in base64? */
+static int
+utf7_plausible(long c)
+{
+    if (c < 0x20)
+        return c == 0x09 || c == 0x0a || c == 0x0d;
+    if ((c >= 0x30 && c <= 0x39) ||
+        ((c | 0x20) >= 0x61 && (c | 0x20) <= 0x7a))
+        return 0; /* Set D, always written directly */
+    if ((c >= 0x7f && c <= 0x9f) || (c >= 0xfdd0 && c <= 0xfdef))
+        return 0; /* controls and noncharacters */
+    return (c & 0xfffe) != 0xfffe;
+}
+
+int
+utf7_sniff(const char *buf, size_t len, struct utf7_sniff *r)
+{
+    size_t i = 0;
+
+    r->good = r->bad = r->escapes = 0;
+    r->verdict = UTF7_SNIFF_ASCII;
+    while (i < len) {
+        unsigned long accum = 0;
+        int bits = 0;
+        int ok = 1;
+        int n = 0;
+        long high = 0;
+        int c;
+
+        /* skip plain text */
+        while (i < len && buf[i] != 0x2b && !(buf[i] & 0x80))
+            i++;
+        if (i == len)
+            break;
+        c = (unsigned char)buf[i++];
+        if (c > 127) {
+            r->verdict = UTF7_SNIFF_OTHER;
+            break;
+        } else if (i < len && buf[i] == 0x2d) {
+            r->escapes++;
+            i++;
+            continue;
+        }
+
+        /* decode a shifted segment, judging each code point */
+        for (; i < len; i++) {
+            int v = utf7_base64d((unsigned char)buf[i]);
+            if (v < 0)
+                break;
+            accum = accum << 6 | v;
+            bits += 6;
+            if (bits >= 16) {
+                long u;
+                bits -= 16;
+                u = accum >> bits;
+                accum &= (1UL << bits) - 1;
+                if (high) {
+                    ok &= utf7_islow(u);
+                    high = 0;
+                } else if (utf7_ishigh(u)) {
+                    high = u;
+                } else {
+                    ok &= !utf7_islow(u) && utf7_plausible(u);
+                }
+                n++;
+            }
+        }
+        if (i == len)
+            break; /* runs off the end, so undecided */
+        if (!ok || !n || high || bits >= 6 || accum)
+            r->bad++;
+        else
+            r->good++;
+        i += buf[i] == 0x2d;
+
+        if ((r->good >= UTF7_SNIFF_ENOUGH && !r->bad) ||
+            (r->bad >= UTF7_SNIFF_ENOUGH && !r->good))
+            break;
+    }
+    r->scanned = i;
+
+    if (r->verdict == UTF7_SNIFF_OTHER) {
+        r->confidence = 100;
+    } else if (r->good > r->bad) {
+        r->verdict = UTF7_SNIFF_UTF7;
+        r->confidence = 100 * r->good / (r->good + r->bad + 1);
+    } else {
+        r->confidence = 100 * (r->bad + 1) / (r->good + r->bad + 1);
+    }
+    return r->verdict;
+}
+
+/* Bytes at the start of s, a '+', that the encoder would write the same
+ * way from the closed state, or zero if that can't be shown. The whole
+ * shifted segment and the byte after its '-' must be in the buffer.
+ * Every code point must be indirect and valid, the first not '+'.
+ */
+static size_t
+utf7_canonical(const struct utf7 *ctx, const char *s, size_t len)
+{
+    unsigned long accum = 0;
+    int bits = 0;
+    int n = 0;
+    long high = 0;
+    size_t q;
+    long c;
+
+    if (len >= 2 && s[1] == 0x2d)
+        return 2; /* "+-" */
+    for (q = 1; q < len; q++) {
+        int v = utf7_base64d((unsigned char)s[q]);
+        if (v < 0)
+            break;
+        accum = accum << 6 | v;
+        bits += 6;
+        if (bits >= 16) {
+            bits -= 16;
+            c = accum >> bits;
+            accum &= (1UL << bits) - 1;
+            if (high) {
+                if (!utf7_islow(c))
+                    return 0;
+                high = 0;
+            } else if (utf7_ishigh(c)) {
+                high = c;
+            } else if (utf7_islow(c) || utf7_isdirect(ctx, c) ||
+                       (!n && c == 0x2b)) {
+                return 0;
+            }
+            n++;
+        }
+    }
+    if (q == len || !n || high || bits >= 6 || accum)
+        return 0;
+
+    /* the next code point must be direct, and '-' only where needed */
+    if (s[q] == 0x2d) {
+        if (++q == len)
+            return 0;
+        c = (unsigned char)s[q];
+        if (!utf7_isdirect(ctx, c))
+            return 0;
+        return c == 0x2d || utf7_base64d(c) >= 0 ? q : 0;
+    }
+    return utf7_isdirect(ctx, (unsigned char)s[q]) ? q : 0;
+}
+
+/* Re-encode one code point into fewer than UTF7_MAX_ENCODE bytes of
+ * output. If it doesn't fit, put the decoder back so that the next
+ * call decodes it again and retries the encoder with the same code
+ * point, and return UTF7_FULL. Otherwise return what was decoded.
+ */
+static long
+utf7_recode_tight(struct utf7 *ctx, struct utf7 *in)
+{
+    struct utf7 save = *in;
+    struct utf7_lenient lsave;
+    long c;
+
+    if (in->lenient)
+        lsave = *in->lenient;
+    c = utf7_decode(in);
+    if (c >= 0 && utf7_encode(ctx, c) == UTF7_FULL) {
+        *in = save;
+        if (in->lenient)
+            *in->lenient = lsave;
+        return UTF7_FULL;
+    }
+    return c;
+}
+
+int
+utf7_canonicalize(struct utf7 *ctx, struct utf7 *in)
+{
+    for (;;) {
+        size_t i, n = 0;
+        long c;
+
+        if (!(in->flags & UTF7_F_OPEN) && !in->high &&
+            (!in->lenient || in->lenient->pending < 0) &&
+            !(ctx->flags & UTF7_F_OPEN) && !ctx->bits) {
+            /* copy what is already canonical */
+            n = utf7_encode_span(ctx, in->buf, in->len);
+            if (n > ctx->len)
+                n = ctx->len;
+            if (!n && in->len && in->buf[0] == 0x2b) {
+                n = utf7_canonical(ctx, in->buf, in->len);
+                if (n > ctx->len)
+                    n = 0;
+            }
+        }
+        if (n) {
+            for (i = 0; i < n; i++)
+                ctx->buf[i] = in->buf[i];
+            ctx->buf += n;
+            ctx->len -= n;
+            in->buf += n;
+            in->len -= n;
+            if (in->lenient)
+                in->lenient->offset += n;
+            continue;
+        }
+
+        /* otherwise re-encode one code point */
+        if (ctx->len < UTF7_MAX_ENCODE) {
+            c = utf7_recode_tight(ctx, in);
+            if (c < 0)
+                return (int)c;
+            continue;
+        }
+        c = utf7_decode(in);
+        if (c < 0)
+            return (int)c;
+        utf7_encode(ctx, c);
+    }
+}
+
+/* Would both decoders handle the same input identically? */
+static int
+utf7_same_state(const struct utf7 *a, const struct utf7 *b)
+{
+    unsigned long mask = (1UL << a->bits) - 1;
+    return a->bits == b->bits &&
+           a->flags == b->flags &&
+           a->high == b->high &&
+           ((a->accum ^ b->accum) & mask) == 0;
+}
+
+int
+utf7_compare(const char *a, size_t alen, const char *b, size_t blen,
+             int *order)
+{
+    struct utf7 x, y;
+
+    utf7_init(&x, 0);
+    utf7_init(&y, 0);
+    x.buf = (char *)a;
+    x.len = alen;
+    y.buf = (char *)b;
+    y.len = blen;
+
+    for (;;) {
+        size_t i, n, nx, ny;
+        long cx, cy;
+
+        /* Direct text on both sides compares byte for byte. */
+        nx = utf7_decode_span(&x, x.buf, x.len);
+        ny = utf7_decode_span(&y, y.buf, y.len);
+        n = nx < ny ? nx : ny;
+        for (i = 0; i < n && x.buf[i] == y.buf[i]; i++);
+        if (i < n) {
+            *order = (unsigned char)x.buf[i] < (unsigned char)y.buf[i] ?
+                     -1 : 1;
+            return UTF7_OK;
+        }
+        x.buf += n;
+        x.len -= n;
+        y.buf += n;
+        y.len -= n;
+
+        /* From the same state, identical bytes decode identically, so
+         * only one side needs decoding to keep track of the state.
+         */
+        if (utf7_same_state(&x, &y)) {
+            n = x.len < y.len ? x.len : y.len;
+            for (i = 0; i < n && x.buf[i] == y.buf[i]; i++);
+            if (i) {
+                size_t rest = x.len - i;
+                x.len = i;
+                while ((cx = utf7_decode(&x)) >= 0);
+                if (cx == UTF7_INVALID)
+                    return UTF7_INVALID;
+                x.len = rest;
+                y.buf += i;
+                y.len -= i;
+                y.accum = x.accum;
+                y.bits = x.bits;
+                y.flags = x.flags;
+                y.high = x.high;
+            }
+        }
+
+        /* Otherwise the spellings differ, so decode and compare. */
+        cx = utf7_decode(&x);
+        cy = utf7_decode(&y);
+        if (cx == UTF7_INVALID || cy == UTF7_INVALID)
+            return UTF7_INVALID;
+        if (cx == UTF7_INCOMPLETE || cy == UTF7_INCOMPLETE)
+            return UTF7_INCOMPLETE;
+        if (cx != cy) {
+            *order = cx < cy ? -1 : 1;
+            return UTF7_OK;
+        }
+        if (cx == UTF7_OK) {
+            *order = 0;
+            return UTF7_OK;
+        }
+    }
+}
+
+int
+utf7_equal(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int order;
+    return utf7_compare(a, alen, b, blen, &order) == UTF7_OK && !order;
+}
+
+void
+utf7_seam_init(struct utf7_seam *seam)
+{
+    seam->accum = 0;
+    seam->bits = 0;
+    seam->open = 0;
+}
+
+int
+utf7_finish(struct utf7 *ctx, struct utf7_seam *seam)
+{
+    int open = !!(ctx->flags & UTF7_F_OPEN);
+
+    if (utf7_partial(ctx) != UTF7_OK)
+        return utf7_full(ctx);
+    /* check for room first, since the seam is only recorded once */
+    if (open && ctx->len < 1 + (ctx->bits > 0))
+        return utf7_full(ctx);
+
+    seam->open = open;
+    seam->bits = open ? ctx->bits : 0;
+    seam->accum = seam->bits ? ctx->accum & ((1UL << seam->bits) - 1) : 0;
+    return utf7_close(ctx, 0x2d);
+}
+
+/* An open left fragment ends with its final base64 character, if any,
+ * and a '-'. Back up over them, restore the pending bits, and encode
+ * the right fragment's code points until one is written directly from
+ * the closed state. From there both encoders agree, so the rest of the
+ * right fragment is copied as is.
+ */
+int
+utf7_append(struct utf7 *ctx, struct utf7_seam *seam, const char *frag,
+            size_t len, const struct utf7_seam *fragseam)
+{
+    struct utf7 save = *ctx;
+    struct utf7 dec;
+    struct utf7_seam end;
+    char keep[2];
+    int trim = 0;
+    int r = UTF7_FULL;
+    size_t i;
+
+    utf7_init(&dec, 0);
+    dec.buf = (char *)frag;
+    dec.len = len;
+
+    if (seam->open) {
+        trim = 1 + (seam->bits > 0);
+        ctx->buf -= trim;
+        ctx->len += trim;
+        keep[0] = ctx->buf[0];
+        keep[1] = ctx->buf[trim - 1];
+        ctx->accum = seam->accum;
+        ctx->bits = seam->bits;
+        ctx->flags = UTF7_F_OPEN | UTF7_F_USED;
+
+        for (;;) {
+            long c = utf7_decode(&dec);
+            if (c == UTF7_OK) {
+                if ((r = utf7_finish(ctx, &end)) != UTF7_OK)
+                    goto fail;
+                *seam = end;
+                return UTF7_OK;
+            }
+            if (c < 0) {
+                r = (int)c;
+                goto fail;
+            }
+            if (utf7_encode(ctx, c) != UTF7_OK)
+                goto fail;
+            if (utf7_isdirect(ctx, c) && !(dec.flags & UTF7_F_OPEN))
+                break;
+        }
+    }
+
+    if (dec.len > ctx->len)
+        goto fail;
+    for (i = 0; i < dec.len; i++)
+        ctx->buf[i] = dec.buf[i];
+    ctx->buf += dec.len;
+    ctx->len -= dec.len;
+    *seam = *fragseam;
     return UTF7_OK;
+
+fail:
+    *ctx = save;
+    if (trim) {
+        ctx->buf[-trim] = keep[0];
+        ctx->buf[-1] = keep[1];
+    }
+    return r == UTF7_FULL ? utf7_full(ctx) : r;
+}
+
+/* Has the decoder just returned a code point that was written
+ * directly, from the closed state? The encoder's output from there on
+ * doesn't depend on anything before it, so old and new bytes can be
+ * joined at such a point.
+ */
+static int
+utf7_synced(const struct utf7 *enc, const struct utf7 *dec, long c)
+{
+    return !(dec->flags & UTF7_F_OPEN) && utf7_isdirect(enc, c) &&
+           (unsigned char)dec->buf[-1] == c;
+}
+
+/* Find the last sync point at or before code point "from", decoding
+ * from the nearest checkpoint and stepping back over checkpoints until
+ * one turns up. The start of the document is always one.
+ */
+static int
+utf7_edit_head(const struct utf7 *enc, const char *doc, size_t len,
+               const struct utf7_index *idx, unsigned long from,
+               unsigned long *head, unsigned long *at)
+{
+    const struct utf7_checkpoint *p = idx ? utf7_index_find(idx, from) : 0;
+    unsigned long limit = len;
+    struct utf7 dec;
+
+    for (;;) {
+        unsigned long cp = 0;
+        int found = !p || !p->byte;
+
+        utf7_init(&dec, 0);
+        dec.buf = (char *)doc;
+        dec.len = limit;
+        if (p) {
+            if (utf7_index_seek(&dec, p) != UTF7_OK || p->byte > limit)
+                return UTF7_INVALID;
+            dec.buf += p->byte;
+            dec.len -= p->byte;
+            cp = p->codepoint;
+        }
+        *head = dec.buf - doc;
+        *at = cp;
+
+        while (cp < from) {
+            long c = utf7_decode(&dec);
+            if (c == UTF7_OK || c == UTF7_INCOMPLETE)
+                break;  /* end of document or of this stretch */
+            if (c < 0)
+                return (int)c;
+            cp++;
+            if (utf7_synced(enc, &dec, c)) {
+                *head = dec.buf - doc;
+                *at = cp;
+                found = 1;
+            }
+        }
+        if (found)
+            return UTF7_OK;
+
+        limit = p->byte;
+        p = p > idx->points ? p - 1 : 0;
+    }
+}
+
+/* Re-encode from the sync point before the edit, through the edit, up
+ * to the first sync point after it. Beyond that the old bytes are what
+ * the encoder would write anyway.
+ */
+int
+utf7_edit(struct utf7 *ctx, const char *doc, size_t len,
+          const struct utf7_index *idx, unsigned long from,
+          unsigned long to, const long *repl, size_t n,
+          struct utf7_splice *splice)
+{
+    struct utf7 save = *ctx;
+    struct utf7 dec;
+    unsigned long head, cp, removed = 0;
+    long c = 0;
+    size_t i;
+    int r;
+
+    r = utf7_edit_head(ctx, doc, len, idx, from, &head, &cp);
+    if (r != UTF7_OK)
+        return r;
+    splice->head = head;
+    splice->codepoint = cp;
+    utf7_reset(ctx);
+    utf7_init(&dec, 0);
+    dec.buf = (char *)doc + head;
+    dec.len = len - head;
+
+    /* the unchanged code points between the sync point and the edit */
+    while (c >= 0 && cp < from) {
+        if ((c = utf7_decode(&dec)) >= 0) {
+            if (utf7_encode(ctx, c) != UTF7_OK)
+                goto full;
+            cp++;
+            removed++;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        if (utf7_encode(ctx, repl[i]) != UTF7_OK)
+            goto full;
+    splice->added = removed + n;
+
+    /* the replaced code points */
+    while (c >= 0 && cp < to) {
+        if ((c = utf7_decode(&dec)) >= 0) {
+            cp++;
+            removed++;
+        }
+    }
+
+    /* the seam: until the old and new encodings line up again */
+    while (c >= 0) {
+        if ((c = utf7_decode(&dec)) < 0)
+            break;
+        if (utf7_encode(ctx, c) != UTF7_OK)
+            goto full;
+        removed++;
+        splice->added++;
+        if (utf7_synced(ctx, &dec, c))
+            break;
+    }
+    if (c < 0) {
+        if (c != UTF7_OK) {
+            *ctx = save;
+            return (int)c;
+        }
+        if (utf7_encode(ctx, UTF7_FLUSH) != UTF7_OK)
+            goto full;
+    }
+
+    splice->tail = dec.buf - doc;
+    splice->length = ctx->buf - save.buf;
+    splice->removed = removed;
+    return UTF7_OK;
+
+full:
+    *ctx = save;
+    return utf7_full(ctx);
+}
+
+void
+utf7_index_splice(struct utf7_index *idx, const struct utf7_splice *s)
+{
+    unsigned long grow = s->length - (s->tail - s->head);
+    size_t i, j = 0;
+
+    /* the prefix is untouched, the middle is gone, the rest moves */
+    for (i = 0; i < idx->count; i++) {
+        struct utf7_checkpoint p = idx->points[i];
+        if (p.byte > s->head) {
+            if (p.byte < s->tail)
+                continue;
+            p.byte += grow;
+            p.codepoint += s->added - s->removed;
+        }
+        idx->points[j++] = p;
+    }
+    idx->count = j;
+    if (idx->next >= s->tail)
+        idx->next += grow;
+    idx->byte += grow;
+    idx->codepoint += s->added - s->removed;
+}
+
+void
+utf7_writer_init(struct utf7_writer *w, const char *indirect,
+                 char *stage, size_t size, utf7_sink sink, void *user)
+{
+    utf7_init(&w->ctx, indirect);
+    w->ctx.buf = stage;
+    w->ctx.len = size;
+    w->sink = sink;
+    w->user = user;
+    w->stage = stage;
+    w->size = size;
+}
+
+/* Hand everything staged so far to the sink. */
+static int
+utf7_writer_drain(struct utf7_writer *w)
+{
+    size_t n = w->ctx.buf - w->stage;
+    w->ctx.buf = w->stage;
+    w->ctx.len = w->size;
+    if (n && w->sink(w->user, w->stage, n))
+        return UTF7_ABORT;
+    return UTF7_OK;
+}
+
+int
+utf7_write(struct utf7_writer *w, long c)
+{
+    /* Keep room for the largest possible encoding so that the encoder
+     * normally never returns UTF7_FULL. A smaller stage still works: it
+     * is drained and the code point retried until it fits.
+     */
+    if (w->ctx.len < UTF7_MAX_ENCODE)
+        if (utf7_writer_drain(w) != UTF7_OK)
+            return UTF7_ABORT;
+    while (utf7_encode(&w->ctx, c) == UTF7_FULL) {
+        if (w->ctx.buf == w->stage)
+            return UTF7_FULL; /* zero-sized stage */
+        if (utf7_writer_drain(w) != UTF7_OK)
+            return UTF7_ABORT;
+    }
+    if (c == UTF7_FLUSH)
+        return utf7_writer_drain(w);
+    return UTF7_OK;
+}
+
+void
+utf7_reader_init(struct utf7_reader *r, char *stage, size_t size,
+                 utf7_source source, void *user)
+{
+    utf7_init(&r->ctx, 0);
+    r->ctx.buf = stage;
+    r->ctx.len = 0;
+    r->source = source;
+    r->user = user;
+    r->stage = stage;
+    r->size = size;
+    r->eof = 0;
+}
+
+long
+utf7_read(struct utf7_reader *r)
+{
+    for (;;) {
+        long n, c = utf7_decode(&r->ctx);
+        if ((c != UTF7_OK && c != UTF7_INCOMPLETE) || r->eof)
+            return c;
+
+        /* refill the stage */
+        n = r->source(r->user, r->stage, r->size);
+        if (n < 0)
+            return UTF7_ABORT;
+        if (!n)
+            r->eof = 1;
+        r->ctx.buf = r->stage;
+        r->ctx.len = n;
+    }
+}
+
+/* Any type's alignment divides the size of this union. */
+union utf7_align {
+    long l;
+    double d;
+    void *p;
+    void (*f)(void);
+};
+
+void *
+utf7_arena_alloc(void *arena, size_t size)
+{
+    struct utf7_arena *a = arena;
+    size_t align = sizeof(union utf7_align);
+    size_t avail = a->end - a->beg;
+    char *p = a->beg;
+
+    if (size > avail)
+        return 0;
+    /* round up, keeping the next allocation aligned */
+    size += (align - size % align) % align;
+    a->beg += size < avail ? size : avail;
+    return p;
+}
+
+#define UTF7_CHAIN_MAX  64  /* chunks in one _alloc output */
+#define UTF7_CHUNK_MIN  64  /* bytes in the smallest chunk */
+
+/* Output for the _alloc functions, in chunks of units of some size.
+ * Written chunks are never copied or resized. Each new chunk is at
+ * least as large as all the chunks before it, so the chain stays short.
+ */
+struct utf7_chain {
+    utf7_allocator alloc;
+    void *user;
+    size_t unit;
+    size_t total;       /* units allocated so far */
+    size_t count;
+    struct utf7_iovec iov[UTF7_CHAIN_MAX];
+};
+
+static void
+utf7_chain_init(struct utf7_chain *ch, utf7_allocator alloc, void *user,
+                size_t unit)
+{
+    ch->alloc = alloc;
+    ch->user = user;
+    ch->unit = unit;
+    ch->total = 0;
+    ch->count = 0;
+}
+
+/* The size of the next chunk in units, given the size it needs. */
+static size_t
+utf7_chain_next(const struct utf7_chain *ch, size_t want)
+{
+    size_t min = (UTF7_CHUNK_MIN + ch->unit - 1) / ch->unit;
+    if (want < ch->total)
+        want = ch->total;
+    return want < min ? min : want;
+}
+
+static int
+utf7_chain_grow(struct utf7_chain *ch, size_t units)
+{
+    void *p;
+    if (ch->count == UTF7_CHAIN_MAX || units > (size_t)-1 / ch->unit)
+        return UTF7_ABORT;
+    p = ch->alloc(ch->user, units * ch->unit);
+    if (!p)
+        return UTF7_ABORT;
+    ch->iov[ch->count].base = p;
+    ch->iov[ch->count].len = units * ch->unit;
+    ch->count++;
+    ch->total += units;
+    return UTF7_OK;
+}
+
+/* Trim the last chunk to the bytes used in it, optionally gather the
+ * chunks into one, and hand the chain over as the output.
+ */
+static int
+utf7_chain_done(struct utf7_chain *ch, size_t used, int flags,
+                struct utf7_output *out)
+{
+    size_t i, j, n = ch->count;
+    size_t total = 0;
+    struct utf7_iovec *iov = 0;
+
+    ch->iov[n - 1].len = used;
+    n -= !used;
+    for (i = 0; i < n; i++)
+        total += ch->iov[i].len;
+
+    if ((flags & UTF7_GATHER) && n > 1) {
+        char *dst = ch->alloc(ch->user, total);
+        if (!dst)
+            return UTF7_ABORT;
+        for (i = 0; i < n; i++) {
+            const char *src = ch->iov[i].base;
+            for (j = 0; j < ch->iov[i].len; j++)
+                *dst++ = src[j];
+        }
+        ch->iov[0].base = dst - total;
+        ch->iov[0].len = total;
+        n = 1;
+    }
+
+    if (n) {
+        iov = ch->alloc(ch->user, n * sizeof(*iov));
+        if (!iov)
+            return UTF7_ABORT;
+        for (i = 0; i < n; i++)
+            iov[i] = ch->iov[i];
+    }
+    out->iov = iov;
+    out->count = n;
+    out->total = total;
+    return UTF7_OK;
+}
+
+/* Guess the encoded size of the input from a sample at its start. In
+ * thirds of a byte, a direct character costs 3, a "+-" escape 6, and a
+ * UTF-16 unit 8, plus 6 to open and close a shifted segment.
+ */
+static size_t
+utf7_encode_estimate(const struct utf7 *ctx, const long *in, size_t len)
+{
+    size_t i, n = len < 32 ? len : 32;
+    size_t thirds = 0, per;
+    int open = 0;
+
+    if (!n)
+        return UTF7_MAX_ENCODE;
+    for (i = 0; i < n; i++) {
+        long c = in[i];
+        if (utf7_isdirect(ctx, c)) {
+            thirds += 3;
+            open = 0;
+        } else if (c == 0x2b && !open) {
+            thirds += 6;
+        } else {
+            thirds += (c >= 0x10000L ? 16 : 8) + (open ? 0 : 6);
+            open = 1;
+        }
+    }
+    per = (thirds + n - 1) / n;
+    return len / 3 * per + per + UTF7_MAX_ENCODE;
+}
+
+int
+utf7_encode_alloc(struct utf7 *ctx, const long *in, size_t len, int flags,
+                  utf7_allocator alloc, void *user, struct utf7_output *out)
+{
+    struct utf7_chain ch;
+    size_t i = 0;
+
+    out->iov = 0;
+    out->count = 0;
+    out->total = 0;
+    utf7_chain_init(&ch, alloc, user, 1);
+    if (utf7_chain_grow(&ch, utf7_encode_estimate(ctx, in, len)) != UTF7_OK)
+        return UTF7_ABORT;
+    ctx->buf = ch.iov[0].base;
+    ctx->len = ch.iov[0].len;
+
+    for (;;) {
+        long c = i < len ? in[i] : UTF7_FLUSH;
+        if (utf7_encode(ctx, c) == UTF7_OK) {
+            if (i++ == len)
+                break;
+            continue;
+        }
+        /* retry the same code point in a fresh chunk */
+        ch.iov[ch.count - 1].len -= ctx->len;
+        if (utf7_chain_grow(&ch, utf7_chain_next(&ch, 0)) != UTF7_OK)
+            return UTF7_ABORT;
+        ctx->buf = ch.iov[ch.count - 1].base;
+        ctx->len = ch.iov[ch.count - 1].len;
+    }
+
+    i = ctx->buf - (char *)ch.iov[ch.count - 1].base;
+    return utf7_chain_done(&ch, i, flags, out);
+}
+
+/* Guess the number of code points in the input from a sample at its
+ * start: in eighths, a direct byte is worth 8 and a base64 byte 3. Any
+ * unsampled byte is counted as a whole code point.
+ */
+static size_t
+utf7_decode_estimate(const struct utf7 *ctx)
+{
+    size_t i, n = ctx->len < 64 ? ctx->len : 64;
+    size_t eighths = 0;
+    int open = !!(ctx->flags & UTF7_F_OPEN);
+
+    if (!n)
+        return 1;
+    for (i = 0; i < n; i++) {
+        int c = (unsigned char)ctx->buf[i];
+        if (open && utf7_base64d(c) != -1) {
+            eighths += 3;
+        } else {
+            open = c == 0x2b;
+            eighths += open ? 0 : 8;
+        }
+    }
+    return ctx->len / n * (eighths / 8) + ctx->len % n + 2;
+}
+
+int
+utf7_decode_alloc(struct utf7 *ctx, int flags, utf7_allocator alloc,
+                  void *user, struct utf7_output *out)
+{
+    struct utf7_chain ch;
+    size_t n = 0, cap;
+    long *dst, c;
+
+    out->iov = 0;
+    out->count = 0;
+    out->total = 0;
+    utf7_chain_init(&ch, alloc, user, sizeof(long));
+    if (utf7_chain_grow(&ch, utf7_decode_estimate(ctx)) != UTF7_OK)
+        return UTF7_ABORT;
+    dst = ch.iov[0].base;
+    cap = ch.iov[0].len / sizeof(long);
+
+    while ((c = utf7_decode(ctx)) >= 0) {
+        if (n == cap) {
+            /* every remaining code point needs at least one byte, plus
+             * this one, plus one a lenient decoder may hold back
+             */
+            size_t want = utf7_chain_next(&ch, 0);
+            if (want > ctx->len + 2)
+                want = ctx->len + 2;
+            if (utf7_chain_grow(&ch, want) != UTF7_OK)
+                return UTF7_ABORT;
+            dst = ch.iov[ch.count - 1].base;
+            cap = want;
+            n = 0;
+        }
+        dst[n++] = c;
+    }
+
+    if (utf7_chain_done(&ch, n * sizeof(long), flags, out) != UTF7_OK)
+        return UTF7_ABORT;
+    return (int)c;
 }
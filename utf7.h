@@ -15,6 +15,68 @@
 #define UTF7_FULL        -2
 #define UTF7_INCOMPLETE  -3
 #define UTF7_INVALID     -4
+#define UTF7_ABORT       -5  /* a sink or source callback failed */
+
+/* Size of a blob written by utf7_save_state(). */
+#define UTF7_STATE_SIZE  8
+
+/* The most bytes a single utf7_encode() call can produce. */
+#define UTF7_MAX_ENCODE  8
+
+/* utf7_sniff() verdicts */
+#define UTF7_SNIFF_ASCII 1  /* 7-bit text with no sign of UTF-7 */
+#define UTF7_SNIFF_UTF7  2  /* 7-bit text with plausible shifted segments */
+#define UTF7_SNIFF_OTHER 3  /* has 8-bit bytes, so neither */
+
+/* utf7_encode_alloc() and utf7_decode_alloc() flags */
+#define UTF7_GATHER      1  /* copy the output into one contiguous chunk */
+
+/* kinds of invalid input */
+#define UTF7_E_BYTE      1  /* byte outside of 7-bit ASCII */
+#define UTF7_E_SHIFT     2  /* empty shifted segment */
+#define UTF7_E_BITS      3  /* too many or non-zero trailing bits */
+#define UTF7_E_PAIR      4  /* unpaired surrogate half */
+
+/* Hot path counters, only maintained when UTF7_STATS is defined. The
+ * library and its callers must agree on UTF7_STATS since it changes the
+ * layout of struct utf7.
+ */
+struct utf7_stats {
+    unsigned long direct;       /* characters written or read directly */
+    unsigned long base64;       /* base64 characters written or read */
+    unsigned long opened;       /* shifted segments opened */
+    unsigned long closed;       /* shifted segments closed */
+    unsigned long dashes;       /* explicit '-' segment terminators */
+    unsigned long escapes;      /* "+-" escapes for '+' */
+    unsigned long surrogates;   /* surrogate pairs */
+    unsigned long full;         /* UTF7_FULL returns */
+    unsigned long incomplete;   /* UTF7_INCOMPLETE returns */
+    unsigned long bad_byte;     /* invalid: 8-bit byte */
+    unsigned long bad_shift;    /* invalid: empty shifted segment */
+    unsigned long bad_bits;     /* invalid: bad trailing base64 bits */
+    unsigned long bad_pair;     /* invalid: unpaired surrogate */
+};
+
+/* An error recorded by a lenient decoder: the bytes consumed from
+ * where the failing utf7_decode() call began to where decoding resumes.
+ */
+struct utf7_error {
+    unsigned long offset;
+    unsigned long length;
+    int kind;
+};
+
+/* Lenient decoding state, attached to a context by utf7_lenient(). */
+struct utf7_lenient {
+    long replacement;
+    struct utf7_error *errors;
+    size_t cap;
+    size_t count;           /* errors seen, may exceed cap */
+    unsigned long offset;   /* stream offset of the context's buf */
+    /* internal fields */
+    const char *start;
+    long pending;
+};
 
 struct utf7 {
     char *buf;
@@ -25,10 +87,230 @@ struct utf7 {
     unsigned flags;
     unsigned high;
     unsigned short direct[8];
+    struct utf7_lenient *lenient;
+#ifdef UTF7_STATS
+    struct utf7_stats stats;
+#endif
+};
+
+/* A direct character set, built once by utf7_set_init() and then
+ * shared read-only between any number of streams.
+ */
+struct utf7_set {
+    unsigned short direct[8];
+};
+
+/* The complete shift state of one idle stream, packed into 8 bytes.
+ * Use utf7_store() and utf7_load() to move it in and out of a working
+ * context. A zeroed state is the initial state.
+ */
+struct utf7_state {
+    unsigned short accum[2];    /* pending bits, low half first */
+    unsigned short info;        /* bit count and flags */
+    unsigned short high;        /* pending high surrogate */
+};
+
+/* What utf7_sniff() found in the bytes it scanned. */
+struct utf7_sniff {
+    unsigned long scanned;  /* bytes examined before stopping */
+    unsigned long good;     /* well-formed, plausible shifted segments */
+    unsigned long bad;      /* malformed or implausible ones */
+    unsigned long escapes;  /* "+-" */
+    int verdict;
+    int confidence;         /* 0 to 100 */
+};
+
+/* How an encoded fragment ends, recorded by utf7_finish() so that
+ * utf7_append() can join fragments while rewriting only the seam.
+ */
+struct utf7_seam {
+    unsigned long accum;    /* bits in the final base64 character */
+    int bits;               /* number of those bits, 0 to 5 */
+    int open;               /* ended a shifted segment with '-' */
+};
+
+/* Where utf7_edit() changed a document: the bytes from head to tail
+ * were replaced by length bytes. The code points from codepoint on that
+ * were spelled by the removed bytes are now spelled by the new ones.
+ */
+struct utf7_splice {
+    unsigned long head;         /* first byte replaced */
+    unsigned long tail;         /* first byte kept after them */
+    unsigned long length;       /* bytes written in their place */
+    unsigned long codepoint;    /* code points before head */
+    unsigned long removed;      /* code points in the replaced bytes */
+    unsigned long added;        /* code points in the new bytes */
+};
+
+/* A place to resume decoding: the input offset, the number of code
+ * points before it, and the decoder state saved there.
+ */
+struct utf7_checkpoint {
+    unsigned long byte;
+    unsigned long codepoint;
+    unsigned char state[UTF7_STATE_SIZE];
+};
+
+/* A checkpoint index over one UTF-7 document. When the checkpoint array
+ * fills, every other checkpoint is dropped and the interval doubles.
+ */
+struct utf7_index {
+    struct utf7_checkpoint *points;
+    size_t cap;
+    size_t count;
+    unsigned long interval;     /* bytes between checkpoints */
+    unsigned long byte;         /* bytes indexed so far */
+    unsigned long codepoint;    /* code points indexed so far */
+    /* internal fields */
+    unsigned long next;
+    struct utf7 ctx;
+};
+
+/* A code point pattern prepared for searching UTF-7 text. */
+struct utf7_search {
+    const long *pattern;
+    size_t len;
+    size_t *table;      /* 2 * len entries of working space */
+    /* internal fields */
+    int first;          /* first code point as a direct byte, or -1 */
+    char forms[3][2];   /* its base64 forms at each alignment */
+};
+
+/* The location of a match: the offset of the first byte of its
+ * encoding, and the number of code points before it.
+ */
+struct utf7_match {
+    unsigned long byte;
+    unsigned long codepoint;
+};
+
+/* Push-mode output. The sink returns zero on success. */
+typedef int (*utf7_sink)(void *user, const char *buf, size_t len);
+
+struct utf7_writer {
+    struct utf7 ctx;
+    utf7_sink sink;
+    void *user;
+    char *stage;
+    size_t size;
+};
+
+/* Pull-mode input. The source returns the number of bytes read, zero
+ * at the end of input, or negative on failure.
+ */
+typedef long (*utf7_source)(void *user, char *buf, size_t len);
+
+struct utf7_reader {
+    struct utf7 ctx;
+    utf7_source source;
+    void *user;
+    char *stage;
+    size_t size;
+    int eof;
+};
+
+/* Memory for the _alloc functions. It returns at least size bytes,
+ * aligned for any type, or null on failure. Nothing is freed through
+ * it, so it's typically an arena that the caller resets as a whole.
+ */
+typedef void *(*utf7_allocator)(void *user, size_t size);
+
+/* A bump allocator over a caller's memory, aligned for any type. Pass
+ * utf7_arena_alloc() and the arena as the allocator and its user data.
+ */
+struct utf7_arena {
+    char *beg;
+    char *end;
+};
+
+/* One chunk of output, laid out like POSIX struct iovec. */
+struct utf7_iovec {
+    void *base;
+    size_t len;     /* in bytes */
+};
+
+/* The chunks written by one _alloc call, in order. */
+struct utf7_output {
+    struct utf7_iovec *iov;
+    size_t count;
+    size_t total;   /* bytes across all chunks */
 };
 
 void utf7_init(struct utf7 *, const char *indirect);
+void utf7_set_init(struct utf7_set *, const char *indirect);
+void utf7_load(struct utf7 *, const struct utf7_set *,
+               const struct utf7_state *);
+void utf7_store(const struct utf7 *, struct utf7_state *);
+void utf7_save_state(const struct utf7 *, unsigned char *blob);
+int  utf7_load_state(struct utf7 *, const unsigned char *blob);
 int  utf7_encode(struct utf7 *, long codepoint);
 long utf7_decode(struct utf7 *);
 
+void utf7_lenient(struct utf7 *, struct utf7_lenient *, long replacement,
+                  struct utf7_error *errors, size_t cap);
+int  utf7_stats(const struct utf7 *, struct utf7_stats *);
+
+size_t utf7_encode_span(const struct utf7 *, const char *, size_t);
+size_t utf7_decode_span(const struct utf7 *, const char *, size_t);
+
+size_t utf7_encode_latin1(struct utf7 *, const char *, size_t);
+long   utf7_decode_latin1(struct utf7 *, char *out, size_t *len);
+
+int  utf7_encode_batch(const struct utf7 *, const long *in,
+                       const size_t *in_off, size_t count,
+                       char *out, size_t cap, size_t *out_off,
+                       size_t *done);
+int  utf7_decode_batch(const char *in, const size_t *in_off, size_t count,
+                       long *out, size_t cap, size_t *out_off,
+                       size_t *done);
+
+void utf7_index_init(struct utf7_index *, struct utf7_checkpoint *points,
+                     size_t cap, unsigned long interval);
+long utf7_index_feed(struct utf7_index *, const char *buf, size_t len);
+const struct utf7_checkpoint *utf7_index_find(const struct utf7_index *,
+                                              unsigned long codepoint);
+int  utf7_index_seek(struct utf7 *, const struct utf7_checkpoint *);
+size_t utf7_index_save(const struct utf7_index *, unsigned char *buf,
+                       size_t len);
+int  utf7_index_load(struct utf7_index *, struct utf7_checkpoint *points,
+                     size_t cap, const unsigned char *buf, size_t len);
+
+void utf7_search_init(struct utf7_search *, const long *pattern,
+                      size_t len, size_t *table);
+int  utf7_search(const struct utf7_search *, const char *buf, size_t len,
+                 unsigned long from, struct utf7_match *);
+
+int  utf7_sniff(const char *buf, size_t len, struct utf7_sniff *);
+
+int  utf7_canonicalize(struct utf7 *, struct utf7 *in);
+
+int  utf7_compare(const char *a, size_t alen, const char *b, size_t blen,
+                  int *order);
+int  utf7_equal(const char *a, size_t alen, const char *b, size_t blen);
+
+void utf7_seam_init(struct utf7_seam *);
+int  utf7_finish(struct utf7 *, struct utf7_seam *);
+int  utf7_append(struct utf7 *, struct utf7_seam *, const char *frag,
+                 size_t len, const struct utf7_seam *);
+
+int  utf7_edit(struct utf7 *, const char *doc, size_t len,
+               const struct utf7_index *, unsigned long from,
+               unsigned long to, const long *repl, size_t n,
+               struct utf7_splice *);
+void utf7_index_splice(struct utf7_index *, const struct utf7_splice *);
+
+void utf7_writer_init(struct utf7_writer *, const char *indirect,
+                      char *stage, size_t size, utf7_sink, void *user);
+int  utf7_write(struct utf7_writer *, long codepoint);
+void utf7_reader_init(struct utf7_reader *, char *stage, size_t size,
+                      utf7_source, void *user);
+long utf7_read(struct utf7_reader *);
+
+void *utf7_arena_alloc(void *arena, size_t size);
+int   utf7_encode_alloc(struct utf7 *, const long *in, size_t len,
+                        int flags, utf7_allocator, void *user,
+                        struct utf7_output *);
+int   utf7_decode_alloc(struct utf7 *, int flags, utf7_allocator,
+                        void *user, struct utf7_output *);
+
 #endif
@@ -0,0 +1,264 @@
+/* Header-only C++17 layer over the UTF-7 stream encoder and decoder
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Link with utf7.c compiled as C. Everything here is a thin inline
+ * wrapper around utf7_encode() and utf7_decode(), so loops over these
+ * ranges and iterators compile down to the same code as hand-written
+ * loops over struct utf7. Only encode_to() allocates.
+ */
+#ifndef UTF7_HPP
+#define UTF7_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#if __cplusplus >= 202002L
+#  include <span>
+#endif
+
+extern "C" {
+#include "utf7.h"
+}
+
+namespace utf7pp {
+
+/* Code points decoded lazily from UTF-7 text. This is a single-pass
+ * input range: iterating advances the view itself. Once iteration
+ * stops, status() says why: UTF7_OK at the end of valid input, or
+ * UTF7_INCOMPLETE or UTF7_INVALID, with offset() at the failure.
+ */
+class decode_view {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = long;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const long *;
+        using reference = long;
+
+        /* the result of it++, which holds on to the old value */
+        struct proxy {
+            long c;
+            long operator*() const noexcept { return c; }
+        };
+
+        iterator() noexcept = default;
+
+        long operator*() const noexcept { return v_->cur_; }
+        iterator &operator++() noexcept { v_->next(); return *this; }
+        proxy operator++(int) noexcept
+        {
+            proxy p = {v_->cur_};
+            v_->next();
+            return p;
+        }
+
+        friend bool operator==(const iterator &a, const iterator &b) noexcept
+        {
+            return a.done() == b.done();
+        }
+        friend bool operator!=(const iterator &a, const iterator &b) noexcept
+        {
+            return a.done() != b.done();
+        }
+
+    private:
+        friend class decode_view;
+        explicit iterator(decode_view *v) noexcept : v_(v) {}
+        bool done() const noexcept { return !v_ || v_->cur_ < 0; }
+        decode_view *v_ = nullptr;
+    };
+
+    explicit decode_view(std::string_view s) noexcept
+    {
+        utf7_init(&ctx_, nullptr);
+        ctx_.buf = const_cast<char *>(s.data());
+        ctx_.len = s.size();
+        start_ = ctx_.buf;
+    }
+#if __cplusplus >= 202002L
+    template <std::size_t N>
+    explicit decode_view(std::span<const char, N> s) noexcept
+        : decode_view(std::string_view(s.data(), s.size())) {}
+#endif
+
+    iterator begin() noexcept
+    {
+        if (!started_) {
+            started_ = true;
+            next();
+        }
+        return iterator(this);
+    }
+    iterator end() noexcept { return iterator(); }
+
+    /* 0 while code points remain, otherwise the final decoder result */
+    int status() const noexcept { return cur_ < 0 ? (int)cur_ : 0; }
+
+    /* bytes consumed so far */
+    std::size_t offset() const noexcept { return ctx_.buf - start_; }
+
+private:
+    void next() noexcept { cur_ = utf7_decode(&ctx_); }
+
+    struct utf7 ctx_;
+    const char *start_;
+    long cur_ = 0;
+    bool started_ = false;
+};
+
+/* An output iterator that encodes each code point assigned through it
+ * and writes the UTF-7 bytes to an underlying output iterator. Call
+ * finish() at the end to close any open shifted segment. It returns
+ * the underlying iterator.
+ */
+template <class Out>
+class encode_iterator {
+public:
+    using iterator_category = std::output_iterator_tag;
+    using value_type = void;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = void;
+
+    explicit encode_iterator(Out out, const char *indirect = nullptr)
+        : out_(out)
+    {
+        utf7_init(&ctx_, indirect);
+    }
+
+    encode_iterator &operator=(long c) { put(c); return *this; }
+    encode_iterator &operator*() noexcept { return *this; }
+    encode_iterator &operator++() noexcept { return *this; }
+    encode_iterator &operator++(int) noexcept { return *this; }
+
+    Out finish()
+    {
+        put(UTF7_FLUSH);
+        return out_;
+    }
+
+private:
+    void put(long c)
+    {
+        char buf[UTF7_MAX_ENCODE];
+        ctx_.buf = buf;
+        ctx_.len = sizeof(buf);
+        utf7_encode(&ctx_, c);
+        for (char *p = buf; p < ctx_.buf; p++)
+            *out_++ = *p;
+    }
+
+    Out out_;
+    struct utf7 ctx_;
+};
+
+/* Encode a range of code points, flushed, to an output iterator. */
+template <class Range, class Out>
+Out encode(const Range &cps, Out out, const char *indirect = nullptr)
+{
+    encode_iterator<Out> it(out, indirect);
+    for (long c : cps)
+        it = c;
+    return it.finish();
+}
+
+struct encode_result {
+    std::size_t read;       /* code points consumed */
+    std::size_t written;    /* bytes written */
+    int status;             /* UTF7_OK, or UTF7_FULL if it didn't fit */
+};
+
+/* Encode a range of code points, flushed, into a fixed buffer. When it
+ * doesn't fit, the buffer holds the start of the encoding, unflushed.
+ */
+template <class Range>
+encode_result encode_into(const Range &cps, char *buf, std::size_t len,
+                          const char *indirect = nullptr)
+{
+    struct utf7 ctx;
+    encode_result r = {0, 0, UTF7_OK};
+    utf7_init(&ctx, indirect);
+    ctx.buf = buf;
+    ctx.len = len;
+    for (long c : cps) {
+        if (utf7_encode(&ctx, c) != UTF7_OK) {
+            r.status = UTF7_FULL;
+            break;
+        }
+        r.read++;
+    }
+    if (r.status == UTF7_OK)
+        r.status = utf7_encode(&ctx, UTF7_FLUSH);
+    r.written = ctx.buf - buf;
+    return r;
+}
+
+#if __cplusplus >= 202002L
+template <class Range>
+encode_result encode_into(const Range &cps, std::span<char> out,
+                          const char *indirect = nullptr)
+{
+    return encode_into(cps, out.data(), out.size(), indirect);
+}
+#endif
+
+/* An estimate of the encoded size of a range of code points. It's an
+ * upper bound as long as every ASCII code point in the range is direct.
+ */
+template <class Range>
+std::size_t encoded_size(const Range &cps)
+{
+    std::size_t n = 0;
+    long prev = 0;
+    for (long c : cps) {
+        n += c < 0x80 ? 1 + (c == 0x2b) : c < 0x10000 ? 3 : 6;
+        n += c >= 0x80 && prev < 0x80 ? 2 : 0;
+        prev = c;
+    }
+    return n;
+}
+
+/* Append the flushed encoding of a range of code points to a string.
+ * Multi-pass ranges are measured with encoded_size() first, so that
+ * the string is grown once and encoded into directly.
+ */
+template <class Range, class Traits, class Alloc>
+std::basic_string<char, Traits, Alloc> &
+encode_to(std::basic_string<char, Traits, Alloc> &s, const Range &cps,
+          const char *indirect = nullptr)
+{
+    using It = decltype(std::begin(cps));
+    using Tag = typename std::iterator_traits<It>::iterator_category;
+    std::size_t used = s.size();
+    std::size_t est = 0;
+    struct utf7 ctx;
+
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, Tag>)
+        est = encoded_size(cps);
+    s.resize(used + est + UTF7_MAX_ENCODE);
+    utf7_init(&ctx, indirect);
+    ctx.buf = &s[used];
+    ctx.len = s.size() - used;
+
+    auto grow = [&] {
+        used = ctx.buf - &s[0];
+        s.resize(s.size() * 2);
+        ctx.buf = &s[used];
+        ctx.len = s.size() - used;
+    };
+    for (long c : cps)
+        while (utf7_encode(&ctx, c) != UTF7_OK)
+            grow();
+    while (utf7_encode(&ctx, UTF7_FLUSH) != UTF7_OK)
+        grow();
+    s.resize(ctx.buf - &s[0]);
+    return s;
+}
+
+} // namespace utf7pp
+
+#endif